@@ -0,0 +1,212 @@
+//
+// accesslog.c: Binary access log.
+// Workers append fixed-size records to their own lock-free ring and never wait:
+// when a ring is full the record is dropped and counted. A background thread
+// drains the rings in batches into ACCESS_LOG_FILE, rotates it and publishes
+// the dropped count in the stats segment. logdecode turns the file back into text.
+//
+
+#include <stdint.h>
+#include "accesslog.h"
+#include "shmstats.h"
+
+AccessLog* access_log;
+
+/* AccessLog mathods implementation */
+
+static uint64_t toUsec(struct timeval* tv)
+{
+    return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+//starts a new log file, -1 if it cannot be created
+static int openLogFile(AccessLog* log)
+{
+    LogFileHeader header;
+
+    log->fd = open(ACCESS_LOG_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, DEF_MODE);
+    if (log->fd < 0)
+    {
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, ACCESS_LOG_MAGIC);
+    header.version = ACCESS_LOG_VERSION;
+    header.record_size = sizeof(LogRecord);
+    log->file_bytes = write(log->fd, &header, sizeof(header));
+    return 0;
+}
+
+//shifts ACCESS_LOG_FILE to .1, .1 to .2 and so on, then starts a new file
+static void rotate(AccessLog* log)
+{
+    char from[MAXLINE], to[MAXLINE];
+
+    close(log->fd);
+    for (int i = ACCESS_LOG_KEEP - 1; i > 0; i--)
+    {
+        sprintf(from, "%s.%d", ACCESS_LOG_FILE, i);
+        sprintf(to, "%s.%d", ACCESS_LOG_FILE, i + 1);
+        rename(from, to);
+    }
+    sprintf(to, "%s.1", ACCESS_LOG_FILE);
+    rename(ACCESS_LOG_FILE, to);
+    openLogFile(log);
+}
+
+//writer thread - moves records from the rings to the file
+static void* writer(void* arg)
+{
+    AccessLog* log = (AccessLog*)arg;
+    LogRecord batch[256];
+    int num;
+
+    while (true)
+    {
+        bool drained = false;
+        uint64_t dropped = 0;
+        for (int i = 0; i < log->rings_num; i++)
+        {
+            LogRing* ring = &log->rings[i];
+            uint64_t head = ring->head;
+            uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+            dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+            for (num = 0; head != tail && num < 256; head++, num++)
+            {
+                batch[num] = ring->records[head & (ACCESS_LOG_RING_SIZE - 1)];
+            }
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+            if (num == 0)
+            {
+                continue;
+            }
+            drained = true;
+            if (log->fd >= 0 || openLogFile(log) >= 0)
+            {
+                ssize_t n = write(log->fd, batch, num * sizeof(LogRecord));
+                log->file_bytes += n > 0 ? n : 0;
+                if (log->file_bytes >= ACCESS_LOG_MAX_BYTES)
+                {
+                    rotate(log);
+                }
+            }
+        }
+        if (stats_segment)
+        {
+            statsSet(&stats_segment->log_dropped, dropped);
+        }
+        if (!drained)
+        {
+            usleep(ACCESS_LOG_FLUSH_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+//
+// Creates the log with one ring per worker and one for the accepting thread,
+// and starts its writer thread
+//
+AccessLog* makeAccessLog(int workers_num)
+{
+    int rings_num = workers_num + 1;
+
+    AccessLog* log = (AccessLog*)malloc(sizeof(AccessLog));
+    if (!log)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    log->rings = (LogRing*)calloc(rings_num, sizeof(LogRing));
+    if (!log->rings)
+    {
+        printf("Memmory allocation error! \n");
+        free(log);
+        return NULL;
+    }
+    log->rings_num = rings_num;
+    log->workers_num = workers_num;
+    openLogFile(log);
+    if (pthread_create(&log->writer, NULL, writer, log))
+    {
+        if (log->fd >= 0)
+        {
+            close(log->fd);
+        }
+        free(log->rings);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+//the next free record of ring, NULL (and counted as dropped) if the ring is full
+static LogRecord* reserve(LogRing* ring)
+{
+    uint64_t tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ACCESS_LOG_RING_SIZE)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return &ring->records[tail & (ACCESS_LOG_RING_SIZE - 1)];
+}
+
+//hands the record taken with reserve to the writer
+static void commit(LogRing* ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+//
+// Appends a record of r, handled by worker index, to the ring of that worker.
+// Never blocks - the record is dropped if the ring is full
+//
+void accessLogAppend(AccessLog* log, int index, Request* r)
+{
+    LogRecord* rec;
+    struct timeval now;
+
+    if (!log || !r || index < 0 || index >= log->workers_num || !(rec = reserve(&log->rings[index])))
+    {
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+    rec->arrival_usec = toUsec(&r->stat_req_arrival);
+    rec->queue_usec = toUsec(&r->stat_req_dispatch);
+    rec->service_usec = toUsec(&now) - rec->arrival_usec - rec->queue_usec;
+    rec->bytes = r->bytes_sent;
+    rec->thread_id = index;
+    rec->status = r->status;
+    memcpy(rec->method, r->method, sizeof(rec->method));
+    memcpy(rec->uri, r->uri, sizeof(rec->uri));
+    commit(&log->rings[index]);
+}
+
+//
+// Appends a record of a connection the accepting thread refused with status,
+// before any request was read. r is its queued request, if it got that far,
+// and NULL otherwise. Never blocks, like accessLogAppend
+//
+void accessLogRefused(AccessLog* log, Request* r, int status, off_t bytes)
+{
+    LogRecord* rec;
+    struct timeval now;
+
+    if (!log || !(rec = reserve(&log->rings[log->workers_num])))
+    {
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+    memset(rec, 0, sizeof(*rec));
+    rec->arrival_usec = toUsec(r ? &r->stat_req_arrival : &now);
+    rec->queue_usec = toUsec(&now) - rec->arrival_usec;
+    rec->bytes = bytes;
+    rec->thread_id = log->workers_num;
+    rec->status = status;
+    commit(&log->rings[log->workers_num]);
+}
@@ -0,0 +1,82 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+#include "segel.h"
+#include "request.h"
+
+/* access log file, rotated to ACCESS_LOG_FILE.1 .. .ACCESS_LOG_KEEP past ACCESS_LOG_MAX_BYTES */
+#define ACCESS_LOG_FILE "./access.log"
+#define ACCESS_LOG_MAX_BYTES (64 * 1024 * 1024)
+#define ACCESS_LOG_KEEP 4
+/* records each worker can buffer before the writer catches up, power of 2 */
+#define ACCESS_LOG_RING_SIZE 4096
+/* how long the writer sleeps when every ring is empty (milliseconds) */
+#define ACCESS_LOG_FLUSH_MS 20
+
+/* file format - a LogFileHeader, then LogRecords back to back */
+#define ACCESS_LOG_MAGIC "HW3ALOG"
+#define ACCESS_LOG_VERSION 1
+/* status of a connection closed unanswered, dropped by the full queue policy */
+#define ACCESS_LOG_DROPPED 0
+
+typedef struct LogFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} LogFileHeader;
+
+/* LogRecord struct definition - one handled request, fixed size */
+typedef struct LogRecord
+{
+    //arrival time, microseconds since the epoch
+    uint64_t arrival_usec;
+    //time spent waiting in the queue, and being served
+    uint64_t queue_usec;
+    uint64_t service_usec;
+    //bytes written to the client
+    uint64_t bytes;
+    uint32_t thread_id;
+    uint16_t status;
+    char method[REQUEST_LOG_METHOD_LEN];
+    char uri[REQUEST_LOG_URI_LEN];
+} LogRecord;
+
+/* LogRing struct definition - single producer (a worker, or the accepting thread),
+   single consumer (the writer) */
+typedef struct LogRing
+{
+    //next record to write out, owned by the writer
+    uint64_t head;
+    char head_pad[64 - sizeof(uint64_t)];
+    //next free slot, owned by the worker
+    uint64_t tail;
+    //records lost because the ring was full
+    uint64_t dropped;
+    char tail_pad[64 - 2 * sizeof(uint64_t)];
+    LogRecord records[ACCESS_LOG_RING_SIZE];
+} LogRing;
+
+/* AccessLog struct definition */
+typedef struct AccessLog
+{
+    //a ring per worker, then one of the thread accepting connections, whose
+    //records carry thread_id == workers_num
+    LogRing* rings;
+    int rings_num;
+    int workers_num;
+    int fd;
+    size_t file_bytes;
+    pthread_t writer;
+} AccessLog;
+
+/* AccessLog mathods */
+AccessLog* makeAccessLog(int workers_num);
+void accessLogAppend(AccessLog* log, int index, Request* r);
+void accessLogRefused(AccessLog* log, Request* r, int status, off_t bytes);
+
+/* global vars */
+extern AccessLog* access_log;
+
+#endif //ACCESSLOG_H
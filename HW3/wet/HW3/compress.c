@@ -0,0 +1,269 @@
+//
+// compress.c: gzip content encoding for static files.
+// Each file is compressed once per version (mtime and size) and the result is
+// kept in a bounded, least recently used cache shared by all worker threads.
+//
+
+#include <zlib.h>
+#include "compress.h"
+
+CompressCache* compress_cache;
+
+/* CompressCache mathods implementation */
+
+//bytes an entry is charged against the cache capacity
+static size_t entrySize(CompressEntry* e)
+{
+    return sizeof(CompressEntry) + strlen(e->node.key) + 1 + e->len;
+}
+
+static void freeEntry(CompressEntry* e)
+{
+    free(e->node.key);
+    if (e->heap)
+    {
+        hugeHeapFree(e->heap, e->data);
+    }
+    else
+    {
+        free(e->data);
+    }
+    free(e);
+}
+
+//must be called with c->lock held
+static CompressEntry* lookup(CompressCache* c, char* filename)
+{
+    return (CompressEntry*)lruLookup(&c->table, filename);
+}
+
+//removes e from the cache, it is freed now or by the last worker releasing it
+//must be called with c->lock held
+static void evict(CompressCache* c, CompressEntry* e)
+{
+    lruRemove(&c->table, &e->node);
+    c->bytes -= entrySize(e);
+    e->evicted = true;
+    if (e->refcount == 0)
+    {
+        freeEntry(e);
+    }
+}
+
+//true when the entry was made from the version of the file sbuf describes
+static bool sameVersion(CompressEntry* e, struct stat* sbuf)
+{
+    return e->mtime.tv_sec == sbuf->st_mtim.tv_sec && e->mtime.tv_nsec == sbuf->st_mtim.tv_nsec &&
+        e->size == sbuf->st_size;
+}
+
+//gzip encodes the file open on srcfd, NULL on failure
+static CompressEntry* compressFile(CompressCache* c, char* filename, int srcfd, struct stat* sbuf)
+{
+    char* srcp;
+    z_stream zs;
+    CompressEntry* e = (CompressEntry*)malloc(sizeof(CompressEntry));
+    if (!e)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    memset(e, 0, sizeof(CompressEntry));
+    e->node.key = malloc(strlen(filename) + 1);
+    if (!e->node.key)
+    {
+        printf("Memmory allocation error! \n");
+        free(e);
+        return NULL;
+    }
+    strcpy(e->node.key, filename);
+    e->mtime = sbuf->st_mtim;
+    e->size = sbuf->st_size;
+
+    //the descriptor the request was validated on, so the data matches sbuf
+    srcp = mmap(0, sbuf->st_size, PROT_READ, MAP_PRIVATE, srcfd, 0);
+    if (srcp == MAP_FAILED)
+    {
+        freeEntry(e);
+        return NULL;
+    }
+
+    //windowBits 15 + 16 selects the gzip wrapper
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        munmap(srcp, sbuf->st_size);
+        freeEntry(e);
+        return NULL;
+    }
+    e->len = deflateBound(&zs, sbuf->st_size);
+    e->data = malloc(e->len);
+    if (e->data)
+    {
+        zs.next_in = (Bytef*)srcp;
+        zs.avail_in = sbuf->st_size;
+        zs.next_out = (Bytef*)e->data;
+        zs.avail_out = e->len;
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < sbuf->st_size)
+        {
+            char* huge = c->heap ? hugeHeapAlloc(c->heap, zs.total_out) : NULL;
+            e->len = zs.total_out;
+            if (huge)
+            {
+                memcpy(huge, e->data, e->len);
+                free(e->data);
+                e->data = huge;
+                e->heap = c->heap;
+            }
+            else
+            {
+                //no heap, or it is too fragmented for this entry
+                e->data = realloc(e->data, e->len);
+            }
+        }
+        else
+        {
+            //not worth encoding - remember that instead
+            free(e->data);
+            e->data = NULL;
+        }
+    }
+    if (!e->data)
+    {
+        e->len = 0;
+    }
+    deflateEnd(&zs);
+    munmap(srcp, sbuf->st_size);
+    return e;
+}
+
+CompressCache* makeCompressCache(size_t capacity)
+{
+    CompressCache* c = (CompressCache*)malloc(sizeof(CompressCache));
+    if (!c)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    lruInit(&c->table, c->buckets, COMPRESS_CACHE_BUCKETS);
+    c->bytes = 0;
+    c->capacity = capacity;
+    pthread_mutex_init(&c->lock, NULL);
+    c->heap = NULL;
+#ifdef USE_HUGEPAGES
+    //the cache bounds what it holds by capacity, so the heap only fails on fragmentation
+    c->heap = makeHugeHeap(capacity);
+#endif
+    return c;
+}
+
+//
+// Returns true for content types that benefit from gzip encoding
+//
+bool isCompressible(char* filetype)
+{
+    return !strncmp(filetype, "text/", 5) || strstr(filetype, "javascript") ||
+        strstr(filetype, "json") || strstr(filetype, "xml");
+}
+
+//
+// Returns the gzip encoding of the file open on fd and described by sbuf,
+// compressing it on a miss. The entry must be handed back with compressCacheRelease.
+// Returns NULL when the file is out of the compressible size range, does not
+// shrink, or could not be read - the caller then serves it as is.
+//
+CompressEntry* compressCacheGet(CompressCache* c, char* filename, int fd, struct stat* sbuf)
+{
+    CompressEntry* e;
+    CompressEntry* old;
+
+    if (!c || sbuf->st_size < COMPRESS_MIN_FILE_SIZE || sbuf->st_size > COMPRESS_MAX_FILE_SIZE)
+    {
+        return NULL;
+    }
+
+    //critical section - hit
+    pthread_mutex_lock(&c->lock);
+    e = lookup(c, filename);
+    if (e && !sameVersion(e, sbuf))
+    {
+        //file changed since it was compressed
+        evict(c, e);
+        e = NULL;
+    }
+    if (e)
+    {
+        lruTouch(&c->table, &e->node);
+        if (!e->data)
+        {
+            e = NULL;
+        }
+        else
+        {
+            e->refcount++;
+        }
+        pthread_mutex_unlock(&c->lock);
+        return e;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    //miss - compress outside the lock so other workers are not held up
+    e = compressFile(c, filename, fd, sbuf);
+    if (!e)
+    {
+        return NULL;
+    }
+
+    //critical section - insert, replacing whatever a concurrent worker inserted
+    pthread_mutex_lock(&c->lock);
+    if ((old = lookup(c, filename)))
+    {
+        evict(c, old);
+    }
+    lruInsert(&c->table, &e->node);
+    c->bytes += entrySize(e);
+    while (c->bytes > c->capacity && c->table.rear != &e->node)
+    {
+        evict(c, (CompressEntry*)c->table.rear);
+    }
+    if (!e->data)
+    {
+        e = NULL;
+    }
+    else
+    {
+        e->refcount++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+void compressCacheRelease(CompressCache* c, CompressEntry* e)
+{
+    if (c && e)
+    {
+        pthread_mutex_lock(&c->lock);
+        if (--e->refcount == 0 && e->evicted)
+        {
+            freeEntry(e);
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+void freeCompressCache(CompressCache* c)
+{
+    if (c)
+    {
+        CompressEntry* e = (CompressEntry*)c->table.front;
+        while (e)
+        {
+            CompressEntry* temp = (CompressEntry*)e->node.next;
+            freeEntry(e);
+            e = temp;
+        }
+        pthread_mutex_destroy(&c->lock);
+        freeHugeHeap(c->heap);
+        free(c);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include "segel.h"
+#include "hugemem.h"
+#include "lru.h"
+
+/* compressed content cache limits (bytes) */
+#define COMPRESS_CACHE_BYTES (16 * 1024 * 1024)
+#define COMPRESS_MIN_FILE_SIZE 256
+#define COMPRESS_MAX_FILE_SIZE (4 * 1024 * 1024)
+#define COMPRESS_CACHE_BUCKETS 256
+
+/* CompressEntry struct definition - gzip encoding of one file version */
+typedef struct CompressEntry
+{
+    //keyed by the path of the original file
+    LruNode node;
+    //version of the original file the data was made from, to the nanosecond
+    struct timespec mtime;
+    off_t size;
+    //gzip encoded content, NULL if the file does not compress well
+    char* data;
+    size_t len;
+    //heap data was allocated from, NULL for malloc
+    HugeHeap* heap;
+    //workers currently writing data out, the entry is freed once 0 and evicted
+    int refcount;
+    bool evicted;
+} CompressEntry;
+
+/* CompressCache struct definition */
+typedef struct CompressCache
+{
+    LruNode* buckets[COMPRESS_CACHE_BUCKETS];
+    LruTable table;
+    //total bytes of compressed data held, bounded by capacity
+    size_t bytes;
+    size_t capacity;
+    pthread_mutex_t lock;
+    //huge page backed heap for the compressed data, NULL to use malloc
+    HugeHeap* heap;
+} CompressCache;
+
+/* CompressCache mathods */
+CompressCache* makeCompressCache(size_t capacity);
+bool isCompressible(char* filetype);
+CompressEntry* compressCacheGet(CompressCache* c, char* filename, int fd, struct stat* sbuf);
+void compressCacheRelease(CompressCache* c, CompressEntry* e);
+void freeCompressCache(CompressCache* c);
+
+/* global vars */
+extern CompressCache* compress_cache;
+
+#endif //COMPRESS_H
@@ -0,0 +1,289 @@
+//
+// coroutine.c: Lets one worker thread serve many connections.
+// Every connection a worker takes off the queue runs requestHandle on its own
+// stackful coroutine over a non-blocking socket. When the socket would block,
+// Rio calls rio_wait_hook, which parks the coroutine on the epoll instance of
+// the worker and switches back to the event loop, which resumes it once the
+// socket is ready or its deadline has passed.
+// Only one coroutine of a worker runs at a time, so requests[index] and
+// threads_handler[index] are swapped to the running coroutine's on resume.
+//
+
+#include <sys/epoll.h>
+#include "coroutine.h"
+#include "request.h"
+#include "thread.h"
+
+//event loop of the calling worker thread
+static __thread CoroutinePool* current_pool;
+
+/* CoroutinePool mathods implementation */
+
+CoroutinePool* makeCoroutinePool(int index)
+{
+    CoroutinePool* pool = (CoroutinePool*)malloc(sizeof(CoroutinePool));
+    if (!pool)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    if ((pool->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->index = index;
+    pool->current = NULL;
+    pool->active = NULL;
+    pool->active_num = 0;
+    pool->free_list = NULL;
+    return pool;
+}
+
+static void freeCoroutine(Coroutine* co)
+{
+    munmap(co->stack, CO_STACK_SIZE);
+    free(co);
+}
+
+//coroutine body - context switches cannot pass pointers, so it finds its
+//coroutine through the pool
+static void coroutineMain(void)
+{
+    Coroutine* co = current_pool->current;
+    requestHandle(co->node->data->connfd, current_pool->index);
+    co->done = true;
+    //returning resumes loop_context (uc_link)
+}
+
+//runs co until it suspends or finishes
+static void resume(CoroutinePool* pool, Coroutine* co)
+{
+    pool->current = co;
+    requests[pool->index] = co->node->data;
+    swapcontext(&pool->loop_context, &co->context);
+    requests[pool->index] = NULL;
+    pool->current = NULL;
+}
+
+//starts serving node on a new or recycled coroutine, false if none could be made
+static bool start(CoroutinePool* pool, Node* node)
+{
+    Coroutine* co = pool->free_list;
+    if (co)
+    {
+        pool->free_list = co->next;
+    }
+    else
+    {
+        co = (Coroutine*)malloc(sizeof(Coroutine));
+        if (!co)
+        {
+            printf("Memmory allocation error! \n");
+            return false;
+        }
+        co->stack = mmap(0, CO_STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (co->stack == MAP_FAILED)
+        {
+            free(co);
+            return false;
+        }
+        //guard page - an overflow faults instead of corrupting the next stack
+        mprotect(co->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    }
+    co->node = node;
+    co->registered = false;
+    co->waiting = false;
+    co->timed_out = false;
+    co->done = false;
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = co->stack;
+    co->context.uc_stack.ss_size = CO_STACK_SIZE;
+    co->context.uc_link = &pool->loop_context;
+    makecontext(&co->context, coroutineMain, 0);
+
+    fcntl(node->data->connfd, F_SETFL, fcntl(node->data->connfd, F_GETFL) | O_NONBLOCK);
+    co->next = pool->active;
+    pool->active = co;
+    pool->active_num++;
+    resume(pool, co);
+    return true;
+}
+
+//closes the connections of finished coroutines and recycles them
+static void reap(CoroutinePool* pool, Scheduler* s)
+{
+    Coroutine** link = &pool->active;
+    while (*link)
+    {
+        Coroutine* co = *link;
+        if (!co->done)
+        {
+            link = &co->next;
+            continue;
+        }
+        *link = co->next;
+        pool->active_num--;
+        if (co->registered)
+        {
+            epoll_ctl(pool->epfd, EPOLL_CTL_DEL, co->node->data->connfd, NULL);
+        }
+        scheduleDone(s, co->node);
+        co->next = pool->free_list;
+        pool->free_list = co;
+    }
+}
+
+//resumes waiting coroutines whose deadline has passed, returns ms until the next deadline
+static int expire(CoroutinePool* pool)
+{
+    struct timeval now, left;
+    int next = -1, ms;
+    Coroutine* co;
+
+    gettimeofday(&now, NULL);
+    for (co = pool->active; co; co = co->next)
+    {
+        if (!co->waiting)
+        {
+            continue;
+        }
+        if (!timercmp(&now, &co->wait_deadline, <))
+        {
+            co->timed_out = true;
+            resume(pool, co);
+            continue;
+        }
+        timersub(&co->wait_deadline, &now, &left);
+        ms = left.tv_sec * 1000 + left.tv_usec / 1000 + 1;
+        if (next < 0 || ms < next)
+        {
+            next = ms;
+        }
+    }
+    return next;
+}
+
+//
+// Serves requests from the scheduler forever, up to CO_PER_WORKER at a time
+//
+void coroutineLoop(CoroutinePool* pool, Scheduler* s)
+{
+    struct epoll_event events[64];
+    int n, timeout;
+
+    current_pool = pool;
+    rio_wait_hook = coroutineWait;
+    while (true)
+    {
+        //take new work - wait for it only when there is nothing else to do
+        while (pool->active_num < CO_PER_WORKER)
+        {
+            Node* node = scheduleNext(s, pool->index, pool->active_num == 0);
+            if (!node)
+            {
+                break;
+            }
+            if (!start(pool, node))
+            {
+                scheduleDone(s, node);
+            }
+        }
+        reap(pool, s);
+        if (pool->active_num == 0)
+        {
+            continue;
+        }
+
+        //wait for sockets, the next deadline, or the next look at the queue
+        timeout = expire(pool);
+        reap(pool, s);
+        if (timeout < 0 || timeout > CO_QUEUE_POLL_MS)
+        {
+            timeout = CO_QUEUE_POLL_MS;
+        }
+        n = epoll_wait(pool->epfd, events, 64, pool->active_num ? timeout : 0);
+        for (int i = 0; i < n; i++)
+        {
+            Coroutine* co = events[i].data.ptr;
+            if (co->waiting)
+            {
+                resume(pool, co);
+            }
+        }
+        reap(pool, s);
+    }
+}
+
+//
+// rio_wait_hook of worker threads - parks the running coroutine until fd is
+// ready for events or the deadline passes
+//
+int coroutineWait(int fd, short events, struct timeval* deadline)
+{
+    CoroutinePool* pool = current_pool;
+    Coroutine* co = pool ? pool->current : NULL;
+    struct epoll_event ev;
+    struct pollfd pfd;
+    bool is_conn;
+
+    if (!co)
+    {
+        //not on a coroutine - plain blocking wait
+        pfd.fd = fd;
+        pfd.events = events;
+        return poll(&pfd, 1, CO_IO_TIMEOUT * 1000) > 0 ? 0 : -1;
+    }
+
+    ev.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0) | EPOLLONESHOT;
+    ev.data.ptr = co;
+    is_conn = fd == co->node->data->connfd;
+    if (epoll_ctl(pool->epfd, is_conn && co->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        return -1;
+    }
+    co->registered |= is_conn;
+    if (deadline && timerisset(deadline))
+    {
+        co->wait_deadline = *deadline;
+    }
+    else
+    {
+        gettimeofday(&co->wait_deadline, NULL);
+        co->wait_deadline.tv_sec += CO_IO_TIMEOUT;
+    }
+    co->timed_out = false;
+    co->waiting = true;
+
+    //back to the event loop until resumed
+    swapcontext(&co->context, &pool->loop_context);
+
+    co->waiting = false;
+    if (!is_conn)
+    {
+        epoll_ctl(pool->epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    if (co->timed_out)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+void freeCoroutinePool(CoroutinePool* pool)
+{
+    if (pool)
+    {
+        Coroutine* co = pool->free_list;
+        while (co)
+        {
+            Coroutine* temp = co->next;
+            freeCoroutine(co);
+            co = temp;
+        }
+        close(pool->epfd);
+        free(pool);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <stdbool.h>
+#include <ucontext.h>
+#include "segel.h"
+#include "scheduler.h"
+
+/* connections a worker thread serves at once */
+#define CO_PER_WORKER 256
+/* stack of each coroutine, mapped lazily so only touched pages cost memory */
+#define CO_STACK_SIZE (256 * 1024)
+/* longest wait for a socket when the caller gave no deadline (seconds) */
+#define CO_IO_TIMEOUT 10
+/* how often a busy worker looks for new requests in the queue (milliseconds) */
+#define CO_QUEUE_POLL_MS 5
+
+/* Coroutine struct definition - one connection served by a worker thread */
+typedef struct Coroutine
+{
+    ucontext_t context;
+    char* stack;
+    //the request being served, owns the connection
+    Node* node;
+    //the connection is registered with the epoll instance of the worker
+    //(other descriptors are registered only while waited for)
+    bool registered;
+    //suspended until readiness or wait_deadline, timed_out set if the deadline came first
+    bool waiting;
+    bool timed_out;
+    struct timeval wait_deadline;
+    //requestHandle returned
+    bool done;
+    struct Coroutine* next;
+} Coroutine;
+
+/* CoroutinePool struct definition - the event loop of one worker thread */
+typedef struct CoroutinePool
+{
+    //worker index, used for requests[index] and threads_handler[index]
+    int index;
+    int epfd;
+    //context of the event loop, where suspended coroutines return to
+    ucontext_t loop_context;
+    Coroutine* current;
+    //coroutines serving a connection, and finished ones kept for their stacks
+    Coroutine* active;
+    int active_num;
+    Coroutine* free_list;
+} CoroutinePool;
+
+/* CoroutinePool mathods */
+CoroutinePool* makeCoroutinePool(int index);
+void coroutineLoop(CoroutinePool* pool, Scheduler* s);
+int coroutineWait(int fd, short events, struct timeval* deadline);
+void freeCoroutinePool(CoroutinePool* pool);
+
+#endif //COROUTINE_H
@@ -0,0 +1,227 @@
+//
+// fdcache.c: Keeps static files open between requests.
+// Workers share reference counted descriptors and stat data, so serving a hot
+// file needs no path lookup, open or close. Entries are trusted for FDCACHE_TTL
+// seconds, after which the file is opened again to pick up changes.
+//
+
+#include "fdcache.h"
+#include <sys/resource.h>
+
+FdCache* fd_cache;
+
+/* FdCache mathods implementation */
+
+static void freeEntry(FdEntry* e)
+{
+    if (e->fd >= 0)
+    {
+        close(e->fd);
+    }
+    free(e->node.key);
+    free(e);
+}
+
+//must be called with c->lock held
+static FdEntry* lookup(FdCache* c, char* filename)
+{
+    FdEntry* e = (FdEntry*)lruLookup(&c->table, filename);
+    return e ? e : (FdEntry*)lruLookup(&c->negative, filename);
+}
+
+//removes e from the cache, it is closed now or by the last worker releasing it
+//must be called with c->lock held
+static void evict(FdCache* c, FdEntry* e)
+{
+    if (e->fd < 0)
+    {
+        lruRemove(&c->negative, &e->node);
+        c->negative_size--;
+    }
+    else
+    {
+        lruRemove(&c->table, &e->node);
+        c->size--;
+    }
+    e->evicted = true;
+    if (e->refcount == 0)
+    {
+        freeEntry(e);
+    }
+}
+
+//opens filename into a new entry, NULL on allocation failure
+static FdEntry* openEntry(char* filename)
+{
+    FdEntry* e = (FdEntry*)malloc(sizeof(FdEntry));
+    if (!e)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    memset(e, 0, sizeof(FdEntry));
+    e->node.key = malloc(strlen(filename) + 1);
+    if (!e->node.key)
+    {
+        printf("Memmory allocation error! \n");
+        free(e);
+        return NULL;
+    }
+    strcpy(e->node.key, filename);
+    e->opened = time(NULL);
+    //close on exec so CGI children do not inherit cached files, non blocking so
+    //opening a FIFO does not wait for a writer
+    e->fd = open(filename, O_RDONLY | O_CLOEXEC | O_NONBLOCK, 0);
+    if (e->fd >= 0 && (fstat(e->fd, &e->sbuf) < 0 || !S_ISREG(e->sbuf.st_mode)))
+    {
+        close(e->fd);
+        e->fd = -1;
+    }
+    return e;
+}
+
+//
+// Returns how many files the cache may keep open, leaving reserved descriptors
+// (the client connections) and FDCACHE_FD_HEADROOM more to the rest of the
+// server. 0 means there is no room to cache at all
+//
+int fdCacheCapacity(int reserved)
+{
+    struct rlimit rl;
+    long available;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+    {
+        return FDCACHE_ENTRIES;
+    }
+    available = (long)rl.rlim_cur - reserved - FDCACHE_FD_HEADROOM;
+    if (available <= 0)
+    {
+        return 0;
+    }
+    return available < FDCACHE_ENTRIES ? available : FDCACHE_ENTRIES;
+}
+
+FdCache* makeFdCache(int capacity)
+{
+    FdCache* c = (FdCache*)malloc(sizeof(FdCache));
+    if (!c)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    lruInit(&c->table, c->buckets, FDCACHE_BUCKETS);
+    c->size = 0;
+    c->capacity = capacity;
+    lruInit(&c->negative, c->negative_buckets, FDCACHE_BUCKETS);
+    c->negative_size = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+//
+// Returns the cache entry of filename, opening the file on a miss or once the
+// entry is stale. The entry must be handed back with fdCacheRelease.
+// Check fd of the entry - it is -1 if the file could not be opened or is not a
+// regular file. Such a failure is cached for FDCACHE_TTL seconds as well, so a
+// missing file costs one open per TTL and a file created later is still found.
+// Returns NULL on allocation failure only
+//
+FdEntry* fdCacheGet(FdCache* c, char* filename)
+{
+    FdEntry* e;
+    FdEntry* old;
+
+    if (!c)
+    {
+        return NULL;
+    }
+
+    //critical section - hit
+    pthread_mutex_lock(&c->lock);
+    e = lookup(c, filename);
+    if (e && time(NULL) - e->opened < FDCACHE_TTL)
+    {
+        lruTouch(&c->table, &e->node);
+        e->refcount++;
+        pthread_mutex_unlock(&c->lock);
+        return e;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    //miss or stale - open outside the lock so other workers are not held up
+    e = openEntry(filename);
+    if (!e)
+    {
+        return NULL;
+    }
+
+    //critical section - insert, replacing the stale entry or a concurrent insert
+    pthread_mutex_lock(&c->lock);
+    if ((old = lookup(c, filename)))
+    {
+        evict(c, old);
+    }
+    if (e->fd < 0)
+    {
+        lruInsert(&c->negative, &e->node);
+        c->negative_size++;
+        while (c->negative_size > FDCACHE_NEGATIVE_ENTRIES)
+        {
+            evict(c, (FdEntry*)c->negative.rear);
+        }
+    }
+    else if (c->capacity <= 0)
+    {
+        //handed out uncached, freed by fdCacheRelease
+        e->evicted = true;
+    }
+    else
+    {
+        lruInsert(&c->table, &e->node);
+        c->size++;
+        while (c->size > c->capacity)
+        {
+            evict(c, (FdEntry*)c->table.rear);
+        }
+    }
+    e->refcount++;
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+void fdCacheRelease(FdCache* c, FdEntry* e)
+{
+    if (c && e)
+    {
+        pthread_mutex_lock(&c->lock);
+        if (--e->refcount == 0 && e->evicted)
+        {
+            freeEntry(e);
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+void freeFdCache(FdCache* c)
+{
+    if (c)
+    {
+        FdEntry* e = (FdEntry*)c->table.front;
+        while (e)
+        {
+            FdEntry* temp = (FdEntry*)e->node.next;
+            freeEntry(e);
+            e = temp;
+        }
+        e = (FdEntry*)c->negative.front;
+        while (e)
+        {
+            FdEntry* temp = (FdEntry*)e->node.next;
+            freeEntry(e);
+            e = temp;
+        }
+        pthread_mutex_destroy(&c->lock);
+        free(c);
+    }
+}
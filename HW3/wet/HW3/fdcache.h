@@ -0,0 +1,58 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <stdbool.h>
+#include "segel.h"
+#include "lru.h"
+
+/* open file cache limits - entries are revalidated FDCACHE_TTL seconds after opening.
+   The cache holds at most FDCACHE_ENTRIES files, fewer when RLIMIT_NOFILE leaves less
+   after the client connections and FDCACHE_FD_HEADROOM more descriptors.
+   Failed opens are remembered too, up to FDCACHE_NEGATIVE_ENTRIES of them */
+#define FDCACHE_ENTRIES 1024
+#define FDCACHE_NEGATIVE_ENTRIES 1024
+#define FDCACHE_FD_HEADROOM 64
+#define FDCACHE_TTL 2
+#define FDCACHE_BUCKETS 1024
+
+/* FdEntry struct definition - an open file and its stat data */
+typedef struct FdEntry
+{
+    //keyed by the path the file was opened by
+    LruNode node;
+    //read-only descriptor, -1 if the open failed or the file is not a regular
+    //one - such negative entries hold no descriptor and are kept apart
+    int fd;
+    struct stat sbuf;
+    //time the file was opened, the entry is stale FDCACHE_TTL seconds later
+    time_t opened;
+    //workers currently using fd, it is closed once 0 and evicted
+    int refcount;
+    bool evicted;
+} FdEntry;
+
+/* FdCache struct definition */
+typedef struct FdCache
+{
+    LruNode* buckets[FDCACHE_BUCKETS];
+    LruTable table;
+    int size;
+    int capacity;
+    //negative entries, not counted against capacity as they use no descriptor
+    LruNode* negative_buckets[FDCACHE_BUCKETS];
+    LruTable negative;
+    int negative_size;
+    pthread_mutex_t lock;
+} FdCache;
+
+/* FdCache mathods */
+int fdCacheCapacity(int reserved);
+FdCache* makeFdCache(int capacity);
+FdEntry* fdCacheGet(FdCache* c, char* filename);
+void fdCacheRelease(FdCache* c, FdEntry* e);
+void freeFdCache(FdCache* c);
+
+/* global vars */
+extern FdCache* fd_cache;
+
+#endif //FDCACHE_H
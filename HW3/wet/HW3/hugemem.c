@@ -0,0 +1,162 @@
+//
+// hugemem.c: Huge page backed memory.
+// Regions come from the hugetlbfs pool (MAP_HUGETLB) when the administrator
+// reserved one, and otherwise from ordinary memory aligned to HUGE_PAGE_SIZE
+// and marked for transparent huge pages, so a few TLB entries cover them and
+// they fault in 2MB at a time.
+//
+
+#include "hugemem.h"
+
+static size_t roundUp(size_t size)
+{
+    return (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+}
+
+/* huge page memory mathods implementation */
+
+//
+// Maps size bytes (rounded up to whole huge pages), NULL on failure.
+// Release with hugeFree and the same size
+//
+void* hugeAlloc(size_t size)
+{
+    char *p, *aligned;
+    size_t head;
+
+    size = roundUp(size);
+    p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        return p;
+    }
+
+    //no reserved huge pages - over map, then trim to an aligned region
+    p = mmap(0, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return NULL;
+    }
+    aligned = (char*)roundUp((size_t)p);
+    head = aligned - p;
+    if (head)
+    {
+        munmap(p, head);
+    }
+    munmap(aligned + size, HUGE_PAGE_SIZE - head);
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+}
+
+void hugeFree(void* p, size_t size)
+{
+    if (p)
+    {
+        munmap(p, roundUp(size));
+    }
+}
+
+HugeHeap* makeHugeHeap(size_t size)
+{
+    HugeHeap* h = (HugeHeap*)malloc(sizeof(HugeHeap));
+    if (!h)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    h->size = roundUp(size);
+    h->base = hugeAlloc(h->size);
+    if (!h->base)
+    {
+        free(h);
+        return NULL;
+    }
+    //the whole region starts out as one free block
+    h->free_list = (HugeBlock*)h->base;
+    h->free_list->size = h->size;
+    h->free_list->next = NULL;
+    pthread_mutex_init(&h->lock, NULL);
+    return h;
+}
+
+//
+// Returns size bytes from the heap, NULL if no free block is large enough
+//
+void* hugeHeapAlloc(HugeHeap* h, size_t size)
+{
+    HugeBlock **link, *b;
+
+    //room for the header, keeping blocks 16 byte aligned
+    size = (size + sizeof(HugeBlock) + 15) & ~(size_t)15;
+
+    pthread_mutex_lock(&h->lock);
+    for (link = &h->free_list; *link && (*link)->size < size; link = &(*link)->next)
+        ;
+    if (!(b = *link))
+    {
+        pthread_mutex_unlock(&h->lock);
+        return NULL;
+    }
+    if (b->size - size >= HUGE_HEAP_MIN_SPLIT)
+    {
+        //split - the tail stays free
+        HugeBlock* rest = (HugeBlock*)((char*)b + size);
+        rest->size = b->size - size;
+        rest->next = b->next;
+        b->size = size;
+        *link = rest;
+    }
+    else
+    {
+        *link = b->next;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return b + 1;
+}
+
+void hugeHeapFree(HugeHeap* h, void* p)
+{
+    HugeBlock *b, *prev = NULL, *next;
+
+    if (!h || !p)
+    {
+        return;
+    }
+    b = (HugeBlock*)p - 1;
+
+    pthread_mutex_lock(&h->lock);
+    for (next = h->free_list; next && next < b; prev = next, next = next->next)
+        ;
+    //merge with the following free block
+    if (next && (char*)b + b->size == (char*)next)
+    {
+        b->size += next->size;
+        next = next->next;
+    }
+    b->next = next;
+    //and with the preceding one
+    if (prev && (char*)prev + prev->size == (char*)b)
+    {
+        prev->size += b->size;
+        prev->next = b->next;
+    }
+    else if (prev)
+    {
+        prev->next = b;
+    }
+    else
+    {
+        h->free_list = b;
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+void freeHugeHeap(HugeHeap* h)
+{
+    if (h)
+    {
+        hugeFree(h->base, h->size);
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef HUGEMEM_H
+#define HUGEMEM_H
+
+#include "segel.h"
+
+/* size (and alignment) of a huge page on x86-64 */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+/* stack of each worker thread - the per request I/O buffers live there */
+#define HUGE_STACK_SIZE (8 * 1024 * 1024)
+/* smallest piece a HugeHeap block is split into */
+#define HUGE_HEAP_MIN_SPLIT 64
+
+/* HugeBlock struct definition - header of a HugeHeap block, free ones are
+   kept in address order so neighbours can be merged */
+typedef struct HugeBlock
+{
+    //bytes including this header
+    size_t size;
+    struct HugeBlock* next;
+} HugeBlock;
+
+/* HugeHeap struct definition - a first fit heap over one hugepage backed region */
+typedef struct HugeHeap
+{
+    char* base;
+    size_t size;
+    HugeBlock* free_list;
+    pthread_mutex_t lock;
+} HugeHeap;
+
+/* huge page memory mathods */
+void* hugeAlloc(size_t size);
+void hugeFree(void* p, size_t size);
+HugeHeap* makeHugeHeap(size_t size);
+void* hugeHeapAlloc(HugeHeap* h, size_t size);
+void hugeHeapFree(HugeHeap* h, void* p);
+void freeHugeHeap(HugeHeap* h);
+
+#endif //HUGEMEM_H
@@ -0,0 +1,72 @@
+/*
+ * logdecode.c: Prints the records of binary access logs as text.
+ *
+ * To run:
+ *      ./logdecode access.log [access.log.1 ...]
+ *
+ * One line per request:
+ *      <arrival, UTC> <thread> <method> <uri> <status> <bytes> <queue us> <service us>
+ * A connection refused before its request was read shows method and uri as "-",
+ * and the accepting thread as the thread after the last worker. One dropped
+ * from the queue by the full queue policy shows status 0.
+ */
+
+#include "segel.h"
+#include "accesslog.h"
+
+int decode(char* path)
+{
+    LogFileHeader header;
+    LogRecord rec;
+    struct tm tm;
+    time_t sec;
+    char when[64];
+    FILE* f = fopen(path, "rb");
+
+    if (!f)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 || strncmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) ||
+        header.version != ACCESS_LOG_VERSION || header.record_size != sizeof(LogRecord))
+    {
+        fprintf(stderr, "%s: not an access log of this server version\n", path);
+        fclose(f);
+        return -1;
+    }
+    while (fread(&rec, sizeof(rec), 1, f) == 1)
+    {
+        if (!rec.method[0])
+        {
+            strcpy(rec.method, "-");
+        }
+        if (!rec.uri[0])
+        {
+            strcpy(rec.uri, "-");
+        }
+        sec = rec.arrival_usec / 1000000;
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", gmtime_r(&sec, &tm));
+        printf("%s.%06luZ %u %.*s %.*s %u %lu %lu %lu\n", when, (unsigned long)(rec.arrival_usec % 1000000),
+            rec.thread_id, (int)sizeof(rec.method), rec.method, (int)sizeof(rec.uri), rec.uri, rec.status,
+            (unsigned long)rec.bytes, (unsigned long)rec.queue_usec, (unsigned long)rec.service_usec);
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int rc = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <access log> ...\n", argv[0]);
+        exit(1);
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        rc |= decode(argv[i]);
+    }
+    return rc ? 1 : 0;
+}
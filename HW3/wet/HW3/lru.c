@@ -0,0 +1,103 @@
+//
+// lru.c: The hash table and recently used list behind the open file cache and
+// the compressed content cache. Each entry is found by its path and the least
+// recently used one is at the rear, where the caches evict from.
+//
+
+#include "lru.h"
+
+/* LruTable mathods implementation */
+
+static unsigned int hashKey(LruTable* t, char* key)
+{
+    unsigned int h = 5381;
+    while (*key)
+    {
+        h = h * 33 + (unsigned char)*key++;
+    }
+    return h % t->num_buckets;
+}
+
+static void unlinkRecent(LruTable* t, LruNode* n)
+{
+    if (n->prev)
+    {
+        n->prev->next = n->next;
+    }
+    else
+    {
+        t->front = n->next;
+    }
+    if (n->next)
+    {
+        n->next->prev = n->prev;
+    }
+    else
+    {
+        t->rear = n->prev;
+    }
+    n->prev = NULL;
+    n->next = NULL;
+}
+
+static void pushRecent(LruTable* t, LruNode* n)
+{
+    n->prev = NULL;
+    n->next = t->front;
+    if (t->front)
+    {
+        t->front->prev = n;
+    }
+    else
+    {
+        t->rear = n;
+    }
+    t->front = n;
+}
+
+//buckets is an array of num_buckets the table uses, it starts out empty
+void lruInit(LruTable* t, LruNode** buckets, unsigned int num_buckets)
+{
+    memset(buckets, 0, num_buckets * sizeof(LruNode*));
+    t->buckets = buckets;
+    t->num_buckets = num_buckets;
+    t->front = NULL;
+    t->rear = NULL;
+}
+
+LruNode* lruLookup(LruTable* t, char* key)
+{
+    LruNode* n = t->buckets[hashKey(t, key)];
+    while (n && strcmp(n->key, key))
+    {
+        n = n->next_in_bucket;
+    }
+    return n;
+}
+
+//adds n as the most recently used entry
+void lruInsert(LruTable* t, LruNode* n)
+{
+    unsigned int bucket = hashKey(t, n->key);
+    n->next_in_bucket = t->buckets[bucket];
+    t->buckets[bucket] = n;
+    pushRecent(t, n);
+}
+
+void lruRemove(LruTable* t, LruNode* n)
+{
+    LruNode** link = &t->buckets[hashKey(t, n->key)];
+    while (*link != n)
+    {
+        link = &(*link)->next_in_bucket;
+    }
+    *link = n->next_in_bucket;
+    unlinkRecent(t, n);
+}
+
+//marks n as the most recently used entry
+void lruTouch(LruTable* t, LruNode* n)
+{
+    unlinkRecent(t, n);
+    pushRecent(t, n);
+}
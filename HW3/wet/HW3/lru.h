@@ -0,0 +1,37 @@
+#ifndef LRU_H
+#define LRU_H
+
+#include "segel.h"
+
+/* LruNode struct definition - the links of an entry kept in an LruTable,
+   embedded as the first member of the entry */
+typedef struct LruNode
+{
+    //the cache key, owned by the entry
+    char* key;
+    //hash bucket chain
+    struct LruNode* next_in_bucket;
+    //recently used order, front is the most recent
+    struct LruNode* prev;
+    struct LruNode* next;
+} LruNode;
+
+/* LruTable struct definition - entries by key, in recently used order.
+   Callers serialize access with a lock of their own */
+typedef struct LruTable
+{
+    LruNode** buckets;
+    unsigned int num_buckets;
+    //most and least recently used entries
+    LruNode* front;
+    LruNode* rear;
+} LruTable;
+
+/* LruTable mathods */
+void lruInit(LruTable* t, LruNode** buckets, unsigned int num_buckets);
+LruNode* lruLookup(LruTable* t, char* key);
+void lruInsert(LruTable* t, LruNode* n);
+void lruRemove(LruTable* t, LruNode* n);
+void lruTouch(LruTable* t, LruNode* n);
+
+#endif //LRU_H
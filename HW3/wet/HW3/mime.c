@@ -0,0 +1,197 @@
+//
+// mime.c: Maps file extensions to content types.
+// Lookups binary search a table sorted by extension, which holds the built-in
+// types below and, after mimeLoad, the types read from a mime.types file.
+// The table is only written at startup, before the worker threads exist.
+//
+
+#include "segel.h"
+#include "mime.h"
+
+/* built-in types, must stay sorted by extension */
+static MimeType builtin_types[] = {
+    { "avif", "image/avif" },
+    { "bmp", "image/bmp" },
+    { "css", "text/css" },
+    { "csv", "text/csv" },
+    { "gif", "image/gif" },
+    { "gz", "application/gzip" },
+    { "htm", "text/html" },
+    { "html", "text/html" },
+    { "ico", "image/x-icon" },
+    { "jpeg", "image/jpeg" },
+    { "jpg", "image/jpeg" },
+    { "js", "text/javascript" },
+    { "json", "application/json" },
+    { "map", "application/json" },
+    { "md", "text/markdown" },
+    { "mjs", "text/javascript" },
+    { "mp3", "audio/mpeg" },
+    { "mp4", "video/mp4" },
+    { "ogg", "audio/ogg" },
+    { "otf", "font/otf" },
+    { "pdf", "application/pdf" },
+    { "png", "image/png" },
+    { "svg", "image/svg+xml" },
+    { "tar", "application/x-tar" },
+    { "ttf", "font/ttf" },
+    { "txt", "text/plain" },
+    { "wasm", "application/wasm" },
+    { "webm", "video/webm" },
+    { "webmanifest", "application/manifest+json" },
+    { "webp", "image/webp" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "xml", "application/xml" },
+    { "zip", "application/zip" },
+};
+
+static MimeType* mime_types = builtin_types;
+static size_t mime_types_num = sizeof(builtin_types) / sizeof(builtin_types[0]);
+
+static int compareExt(const void* a, const void* b)
+{
+    return strcmp(((const MimeType*)a)->ext, ((const MimeType*)b)->ext);
+}
+
+static char* copyString(char* s)
+{
+    char* copy = malloc(strlen(s) + 1);
+    if (copy)
+    {
+        strcpy(copy, s);
+    }
+    return copy;
+}
+
+//
+// Merges the types of a mime.types file ("type ext1 ext2 ..." lines, # comments)
+// over the current table. Returns the number of extensions read, -1 on error
+//
+int mimeLoad(char* path)
+{
+    char line[MAXLINE], *type, *ext, *saveptr;
+    MimeType* table;
+    size_t num = 0, capacity = mime_types_num, i, j;
+    int loaded = 0;
+    FILE* f = fopen(path, "r");
+
+    if (!f)
+    {
+        return -1;
+    }
+    table = (MimeType*)malloc(capacity * sizeof(MimeType));
+    if (!table)
+    {
+        printf("Memmory allocation error! \n");
+        fclose(f);
+        return -1;
+    }
+
+    //file entries first, so they win over the current ones below
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "#")] = '\0';
+        if (!(type = strtok_r(line, " \t\r\n", &saveptr)))
+        {
+            continue;
+        }
+        while ((ext = strtok_r(NULL, " \t\r\n", &saveptr)))
+        {
+            if (num == capacity)
+            {
+                MimeType* grown = (MimeType*)realloc(table, 2 * capacity * sizeof(MimeType));
+                if (!grown)
+                {
+                    break;
+                }
+                table = grown;
+                capacity *= 2;
+            }
+            for (char* c = ext; *c; c++)
+            {
+                *c = tolower(*c);
+            }
+            table[num].ext = copyString(ext);
+            table[num].type = copyString(type);
+            if (!table[num].ext || !table[num].type)
+            {
+                free(table[num].ext);
+                free(table[num].type);
+                break;
+            }
+            num++;
+            loaded++;
+        }
+    }
+    fclose(f);
+
+    if (num + mime_types_num > capacity)
+    {
+        MimeType* grown = (MimeType*)realloc(table, (num + mime_types_num) * sizeof(MimeType));
+        if (!grown)
+        {
+            for (i = 0; i < num; i++)
+            {
+                free(table[i].ext);
+                free(table[i].type);
+            }
+            free(table);
+            return -1;
+        }
+        table = grown;
+    }
+    memcpy(table + num, mime_types, mime_types_num * sizeof(MimeType));
+    num += mime_types_num;
+
+    //sort (stable for equal extensions) and keep the first of each extension
+    for (i = 1; i < num; i++)
+    {
+        MimeType temp = table[i];
+        for (j = i; j > 0 && compareExt(&table[j - 1], &temp) > 0; j--)
+        {
+            table[j] = table[j - 1];
+        }
+        table[j] = temp;
+    }
+    for (i = 0, j = 0; i < num; i++)
+    {
+        if (j == 0 || strcmp(table[j - 1].ext, table[i].ext))
+        {
+            table[j++] = table[i];
+        }
+    }
+
+    //entries replaced by the file are leaked - this runs once at startup
+    if (mime_types != builtin_types)
+    {
+        free(mime_types);
+    }
+    mime_types = table;
+    mime_types_num = j;
+    return loaded;
+}
+
+//
+// Returns the content type for the final extension of filename, NULL if unknown
+//
+char* mimeLookup(char* filename)
+{
+    char ext[16];
+    char* dot = strrchr(filename, '.');
+    MimeType key, *found;
+    size_t i;
+
+    if (!dot || strchr(dot, '/') || strlen(dot + 1) >= sizeof(ext))
+    {
+        return NULL;
+    }
+    for (i = 0; dot[i + 1]; i++)
+    {
+        ext[i] = tolower(dot[i + 1]);
+    }
+    ext[i] = '\0';
+    key.ext = ext;
+    found = bsearch(&key, mime_types, mime_types_num, sizeof(MimeType), compareExt);
+    return found ? found->type : NULL;
+}
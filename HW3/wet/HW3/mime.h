@@ -0,0 +1,19 @@
+#ifndef MIME_H
+#define MIME_H
+
+/* mime.types file merged over the built-in table at startup, if present */
+#define MIME_TYPES_FILE "./mime.types"
+
+/* MimeType struct definition - one extension to content type mapping */
+typedef struct MimeType
+{
+    //lower case file extension, without the dot
+    char* ext;
+    char* type;
+} MimeType;
+
+/* MimeType mathods */
+int mimeLoad(char* path);
+char* mimeLookup(char* filename);
+
+#endif //MIME_H
@@ -11,6 +11,7 @@ Node* makeNode(int connfd)
     }
     new_node->prev = NULL;
     new_node->next = NULL;
+    new_node->flow_next = NULL;
     new_node->data = makeRequest(connfd);
     return new_node;
 }
\ No newline at end of file
@@ -13,6 +13,8 @@ typedef struct Node
     Request* data;
     struct Node* prev;
     struct Node* next;
+    //next request of the same client, fair queuing only
+    struct Node* flow_next;
 } Node;
 
 /* Nodes mathods */
@@ -0,0 +1,222 @@
+//
+// parser.c: Single pass request head parser.
+// Works in place on the head as read into the rio_t buffer: every field is a
+// view into that buffer, cut off by writing a NUL over the delimiter after it.
+// Nothing is copied, and percent-encoding is left alone until a caller asks
+// for a decoded copy.
+//
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include "parser.h"
+
+/* RequestHead mathods implementation */
+
+//true for the bytes a header field name (or method) may contain
+static bool isToken(char c)
+{
+    return c > ' ' && c < 0x7f && !strchr("\"(),/:;<=>?@[\\]{}", c);
+}
+
+//moves *p past an end of line (CRLF or a bare LF), false if there is none at *p
+static bool skipEol(char** p, char* end)
+{
+    if (*p < end && **p == '\r')
+    {
+        (*p)++;
+    }
+    if (*p < end && **p == '\n')
+    {
+        (*p)++;
+        return true;
+    }
+    return false;
+}
+
+//
+// Parses the request head in buf[0..len), which ends with an empty line.
+// Fills head with views into buf.
+// Returns PARSE_OK, PARSE_ERROR if the head is malformed or
+// PARSE_TOO_MANY_HEADERS if it has more than PARSER_MAX_HEADERS fields
+//
+int parseRequestHead(char* buf, size_t len, RequestHead* head)
+{
+    char *p = buf, *end = buf + len, *start;
+
+    memset(head, 0, sizeof(*head));
+
+    //method
+    for (start = p; p < end && isToken(*p); p++)
+        ;
+    if (p == start || p == end || *p != ' ')
+    {
+        return PARSE_ERROR;
+    }
+    head->method.data = start;
+    head->method.len = p - start;
+    *p++ = '\0';
+
+    //request target - path, then an optional query
+    for (start = p; p < end && *p > ' ' && *p != 0x7f && *p != '?'; p++)
+        ;
+    if (p == start || p == end)
+    {
+        return PARSE_ERROR;
+    }
+    head->path.data = start;
+    head->path.len = p - start;
+    if (*p == '?')
+    {
+        *p++ = '\0';
+        for (start = p; p < end && *p > ' ' && *p != 0x7f; p++)
+            ;
+        head->query.data = start;
+        head->query.len = p - start;
+    }
+    if (p == end || (*p != ' ' && *p != '\r' && *p != '\n'))
+    {
+        return PARSE_ERROR;
+    }
+
+    //protocol version, may be missing
+    start = p;
+    if (*p == ' ')
+    {
+        //also ends the path or query
+        *p++ = '\0';
+        for (start = p; p < end && *p > ' ' && *p != 0x7f; p++)
+            ;
+        if (p - start < 5 || strncmp(start, "HTTP/", 5))
+        {
+            return PARSE_ERROR;
+        }
+    }
+    head->version.data = start;
+    head->version.len = p - start;
+    start = p;
+    if (!skipEol(&p, end))
+    {
+        return PARSE_ERROR;
+    }
+    *start = '\0';
+    if (!head->query.data)
+    {
+        //no query - the empty string right after the path
+        head->query.data = head->path.data + head->path.len;
+    }
+
+    //header fields, up to the empty line
+    while (!skipEol(&p, end))
+    {
+        HeaderField* field;
+        char* value_end;
+
+        if (head->headers_num == PARSER_MAX_HEADERS)
+        {
+            return PARSE_TOO_MANY_HEADERS;
+        }
+        field = &head->headers[head->headers_num];
+
+        for (start = p; p < end && isToken(*p); p++)
+            ;
+        if (p == start || p == end || *p != ':')
+        {
+            return PARSE_ERROR;
+        }
+        field->name.data = start;
+        field->name.len = p - start;
+        *p++ = '\0';
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+        {
+            p++;
+        }
+        for (start = value_end = p; p < end && *p != '\r' && *p != '\n'; p++)
+        {
+            if (*p != ' ' && *p != '\t')
+            {
+                value_end = p + 1;
+            }
+        }
+        if (!skipEol(&p, end))
+        {
+            return PARSE_ERROR;
+        }
+        field->value.data = start;
+        field->value.len = value_end - start;
+        *value_end = '\0';
+        head->headers_num++;
+    }
+    return p == end ? PARSE_OK : PARSE_ERROR;
+}
+
+//
+// Returns the value of the first header field called name (case insensitive),
+// NULL if the request has none
+//
+StrView* headerFind(RequestHead* head, char* name)
+{
+    size_t len = strlen(name);
+
+    for (int i = 0; i < head->headers_num; i++)
+    {
+        if (head->headers[i].name.len == len && !strncasecmp(head->headers[i].name.data, name, len))
+        {
+            return &head->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+static int hexValue(char c)
+{
+    if (isdigit(c))
+    {
+        return c - '0';
+    }
+    c = tolower(c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+//
+// Writes v with its %XX escapes decoded, and a NUL, to out (size bytes).
+// Returns the decoded length, or -1 if v has a bad escape, decodes to a NUL
+// or does not fit
+//
+ssize_t percentDecode(StrView* v, char* out, size_t size)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < v->len; i++, n++)
+    {
+        char c = v->data[i];
+        if (c == '%')
+        {
+            int hi, lo;
+            if (i + 2 >= v->len)
+            {
+                return -1;
+            }
+            hi = hexValue(v->data[i + 1]);
+            lo = hexValue(v->data[i + 2]);
+            if (hi < 0 || lo < 0 || (hi == 0 && lo == 0))
+            {
+                return -1;
+            }
+            c = hi * 16 + lo;
+            i += 2;
+        }
+        if (n + 1 >= size)
+        {
+            return -1;
+        }
+        out[n] = c;
+    }
+    if (n >= size)
+    {
+        return -1;
+    }
+    out[n] = '\0';
+    return n;
+}
@@ -0,0 +1,49 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* most header fields a request head may carry */
+#define PARSER_MAX_HEADERS 64
+
+/* parseRequestHead results */
+#define PARSE_OK 0
+#define PARSE_ERROR -1
+#define PARSE_TOO_MANY_HEADERS -2
+
+/* StrView struct definition - a piece of the request head, no copy made.
+   The parser NUL terminates every view in place, so data is also a C string */
+typedef struct StrView
+{
+    char* data;
+    size_t len;
+} StrView;
+
+/* HeaderField struct definition */
+typedef struct HeaderField
+{
+    StrView name;
+    StrView value;
+} HeaderField;
+
+/* RequestHead struct definition - request line and header fields */
+typedef struct RequestHead
+{
+    StrView method;
+    //request target, split at the first '?'. query is empty if there is none
+    StrView path;
+    StrView query;
+    //empty for a request line without one
+    StrView version;
+    HeaderField headers[PARSER_MAX_HEADERS];
+    int headers_num;
+} RequestHead;
+
+/* RequestHead mathods */
+int parseRequestHead(char* buf, size_t len, RequestHead* head);
+StrView* headerFind(RequestHead* head, char* name);
+ssize_t percentDecode(StrView* v, char* out, size_t size);
+
+#endif //PARSER_H
@@ -4,8 +4,182 @@
 #include "queue.h"
 #include "request.h"
 #include "thread.h"
+#include "shmstats.h"
+#include "accesslog.h"
 
 /* Queue mathods implementation */
+
+//wakes workers for the waiting requests, must be called with q->global_lock held.
+//A batch insert does it once at the end, or before it blocks on a full queue
+static void wakeWorkers(Queue* q)
+{
+    if (q->size == 1)
+    {
+        pthread_cond_signal(&q->deletion_allowed);
+    }
+    else if (q->size > 1)
+    {
+        pthread_cond_broadcast(&q->deletion_allowed);
+    }
+}
+
+//closes a connection the full queue policy dropped. Only the accepting thread
+//inserts, so the drop goes to the access log ring it owns
+static void dropNode(Node* to_drop)
+{
+    accessLogRefused(access_log, to_drop->data, ACCESS_LOG_DROPPED, 0);
+    Close(to_drop->data->connfd);
+    free(to_drop->data);
+    free(to_drop);
+}
+
+//true while the waiting, stashed and active requests take up every connection slot
+static bool noRoom(Queue* q)
+{
+    return q->size >= q->http_connections_num - __atomic_load_n(&q->active_requests_num, __ATOMIC_RELAXED) -
+        __atomic_load_n(&q->stashed_num, __ATOMIC_RELAXED);
+}
+
+//shows the queue size in the stats segment, must be called with q->global_lock held
+static void publishSize(Queue* q)
+{
+    if (stats_segment)
+    {
+        statsSet(&stats_segment->queue_size, q->size);
+        statsSet(&stats_segment->queue_capacity, q->http_connections_num);
+    }
+}
+
+//the link pointing at the flow of client_addr in its hash bucket
+static Flow** flowLink(Queue* q, uint32_t client_addr)
+{
+    Flow** link = &q->flows[(client_addr * 2654435761u >> 8) % QUEUE_FLOW_BUCKETS];
+    while (*link && (*link)->client_addr != client_addr)
+    {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+//appends a request to the flow of its client, opening the flow if needed
+static bool flowPush(Queue* q, Node* to_insert)
+{
+    Flow** link = flowLink(q, to_insert->data->client_addr);
+    Flow* f = *link;
+    if (!f)
+    {
+        f = (Flow*)malloc(sizeof(Flow));
+        if (!f)
+        {
+            printf("Memmory allocation error! \n");
+            return false;
+        }
+        f->client_addr = to_insert->data->client_addr;
+        f->front = NULL;
+        f->rear = NULL;
+        f->size = 0;
+        f->hash_next = NULL;
+        *link = f;
+        //new client - served after the ones already waiting
+        f->next = NULL;
+        if (q->flows_rear)
+        {
+            q->flows_rear->next = f;
+        }
+        else
+        {
+            q->flows_front = f;
+        }
+        q->flows_rear = f;
+    }
+    if (f->rear)
+    {
+        f->rear->flow_next = to_insert;
+    }
+    else
+    {
+        f->front = to_insert;
+    }
+    f->rear = to_insert;
+    f->size++;
+    return true;
+}
+
+//
+// Takes the oldest request of flow f, which follows prev in the serving order
+// (NULL if f is first). If rotate is set, f moves to the back of the order.
+// A flow left with no requests is closed
+//
+static Node* flowTake(Queue* q, Flow* f, Flow* prev, bool rotate)
+{
+    Node* taken = f->front;
+    f->front = taken->flow_next;
+    taken->flow_next = NULL;
+    if (!f->front)
+    {
+        f->rear = NULL;
+    }
+    f->size--;
+
+    if (f->size == 0 || rotate)
+    {
+        if (prev)
+        {
+            prev->next = f->next;
+        }
+        else
+        {
+            q->flows_front = f->next;
+        }
+        if (q->flows_rear == f)
+        {
+            q->flows_rear = prev;
+        }
+        f->next = NULL;
+        if (f->size > 0)
+        {
+            if (q->flows_rear)
+            {
+                q->flows_rear->next = f;
+            }
+            else
+            {
+                q->flows_front = f;
+            }
+            q->flows_rear = f;
+        }
+        else
+        {
+            *flowLink(q, f->client_addr) = f->hash_next;
+            free(f);
+        }
+    }
+    return taken;
+}
+
+//unlinks a node from anywhere in the queue, the caller updates size
+static void unlinkNode(Queue* q, Node* to_unlink)
+{
+    if (to_unlink->prev)
+    {
+        to_unlink->prev->next = to_unlink->next;
+    }
+    else
+    {
+        q->front = to_unlink->next;
+    }
+    if (to_unlink->next)
+    {
+        to_unlink->next->prev = to_unlink->prev;
+    }
+    else
+    {
+        q->rear = to_unlink->prev;
+    }
+    to_unlink->prev = NULL;
+    to_unlink->next = NULL;
+}
+
 Queue* makeQueue(int pool_size, int http_connections_num, char* schedalg, int max_size,
     pthread_mutex_t global_lock, pthread_cond_t insertion_allowed,
     pthread_cond_t deletion_allowed, pthread_cond_t is_empty) 
@@ -30,26 +204,56 @@ Queue* makeQueue(int pool_size, int http_connections_num, char* schedalg, int ma
     }
     strcpy(new_queue->schedalg, schedalg);
     new_queue->active_requests_num = 0;
+    new_queue->stashed_num = 0;
+    new_queue->idle_workers = 0;
+    new_queue->stashes = (QueueStash*)aligned_alloc(sizeof(QueueStash), pool_size * sizeof(QueueStash));
+    if (!new_queue->stashes)
+    {
+        printf("Memmory allocation error! \n");
+        free(new_queue->schedalg);
+        free(new_queue);
+        return NULL;
+    }
+    memset(new_queue->stashes, 0, pool_size * sizeof(QueueStash));
     new_queue->max_size = max_size;
     new_queue->global_lock = global_lock;
     new_queue->insertion_allowed = insertion_allowed;
     new_queue->deletion_allowed = deletion_allowed;
     new_queue->is_empty = is_empty;
+    new_queue->flows = NULL;
+    new_queue->flows_front = NULL;
+    new_queue->flows_rear = NULL;
+    if (!strcmp(schedalg, "fq"))
+    {
+        new_queue->flows = (Flow**)calloc(QUEUE_FLOW_BUCKETS, sizeof(Flow*));
+        if (!new_queue->flows)
+        {
+            printf("Memmory allocation error! \n");
+            free(new_queue->stashes);
+            free(new_queue->schedalg);
+            free(new_queue);
+            return NULL;
+        }
+    }
 
     return new_queue;
 }
 
-bool enqueue(Queue* q, Node* to_insert) 
+//
+// Inserts a request applying the full queue policy, must be called with
+// q->global_lock held. Waiting workers are not woken, that is up to the caller.
+// Returns false if the request was dropped
+//
+static bool insert(Queue* q, Node* to_insert) 
 {
     if (q && to_insert)
     {
-        //critical section
-        pthread_mutex_lock(&q->global_lock);
-        while (isFull(q, q->http_connections_num )|| isFull(q, q->http_connections_num - q->active_requests_num))
+        while (noRoom(q))
         {
             //block
             if (!strcmp(q->schedalg, "block")) 
             {
+                wakeWorkers(q);
                 pthread_cond_wait(&q->insertion_allowed, &q->global_lock);
             }
             //drop_tail 
@@ -61,23 +265,19 @@ bool enqueue(Queue* q, Node* to_insert)
                 (isEmpty(q) && !strcmp(q->schedalg, "random")) ||
                 (!strcmp(q->schedalg, "dynamic") && q->size == q->max_size))
             {
-                Close(to_insert->data->connfd);
-                free(to_insert->data);
-                free(to_insert);
-                pthread_mutex_unlock(&q->global_lock);
+                dropNode(to_insert);
                 return false;
             }
             //drop_head
             else if (!strcmp(q->schedalg, "dh")) 
             {
                 Node* to_dequeue = dequeue(q, false);
-                Close(to_dequeue->data->connfd);
-                free(to_dequeue->data);
-                free(to_dequeue);
+                dropNode(to_dequeue);
             }
             //block_flush
             else if (!strcmp(q->schedalg, "bf"))
             {
+                wakeWorkers(q);
                 pthread_cond_wait(&(q->is_empty), &(q->global_lock));
             }
             //Dynamic
@@ -85,10 +285,7 @@ bool enqueue(Queue* q, Node* to_insert)
             {
                 //assert queue has not reached max size
                 q->http_connections_num++;
-                Close(to_insert->data->connfd);
-                free(to_insert->data);
-                free(to_insert);
-                pthread_mutex_unlock(&(q->global_lock));
+                dropNode(to_insert);
                 return false;
             }
             //random
@@ -107,6 +304,30 @@ bool enqueue(Queue* q, Node* to_insert)
                     cond_dequeue(q, rand() % q->size);
                 }
             }
+            //fair queuing - drop the oldest request of the client with the most
+            //waiting, or the new one if its own client is that client
+            else if (!strcmp(q->schedalg, "fq"))
+            {
+                Flow *f, *prev = NULL, *max = NULL, *max_prev = NULL;
+                Flow* own = *flowLink(q, to_insert->data->client_addr);
+                for (f = q->flows_front; f; prev = f, f = f->next)
+                {
+                    if (!max || f->size > max->size)
+                    {
+                        max = f;
+                        max_prev = prev;
+                    }
+                }
+                if (!max || (own && own->size >= max->size))
+                {
+                    dropNode(to_insert);
+                    return false;
+                }
+                Node* to_drop = flowTake(q, max, max_prev, false);
+                unlinkNode(q, to_drop);
+                q->size--;
+                dropNode(to_drop);
+            }
             else
             {
                 //arguments where not passed correctly by user - abort
@@ -114,6 +335,12 @@ bool enqueue(Queue* q, Node* to_insert)
             }
         }
 
+        if (q->flows && !flowPush(q, to_insert))
+        {
+            dropNode(to_insert);
+            return false;
+        }
+
         //queue is not full, can insert
         if (q->size > 0) 
         {
@@ -128,27 +355,62 @@ bool enqueue(Queue* q, Node* to_insert)
             q->rear = to_insert;
         }
         q->size++;
-        pthread_cond_signal(&q->deletion_allowed);
-        pthread_mutex_unlock(&q->global_lock);
+        publishSize(q);
         return true;
     }
     return false;
 }
 
-Node* dequeue(Queue* q, bool is_critical) 
+bool enqueue(Queue* q, Node* to_insert) 
 {
-    if (q)
+    bool inserted = false;
+    if (q && to_insert)
     {
-        if (is_critical)
+        //critical section
+        pthread_mutex_lock(&q->global_lock);
+        if ((inserted = insert(q, to_insert)))
         {
-            pthread_mutex_lock(&q->global_lock);
+            pthread_cond_signal(&q->deletion_allowed);
         }
-        Node* to_dequeue;
-        while (isEmpty(q)) 
+        pthread_mutex_unlock(&q->global_lock);
+    }
+    return inserted;
+}
+
+//
+// Inserts n requests under a single lock acquisition and wakes as many
+// workers as there are new requests at once. Returns the number inserted
+//
+int enqueueBatch(Queue* q, Node** to_insert, int n)
+{
+    int inserted = 0;
+    if (q)
+    {
+        //critical section
+        pthread_mutex_lock(&q->global_lock);
+        for (int i = 0; i < n; i++)
         {
-            pthread_cond_wait(&q->deletion_allowed, &q->global_lock);
+            inserted += insert(q, to_insert[i]);
         }
-        //queue not empty, can dequeue
+        wakeWorkers(q);
+        pthread_mutex_unlock(&q->global_lock);
+    }
+    return inserted;
+}
+
+//unlinks the next request to serve, must be called with q->global_lock held
+//and the queue not empty
+static Node* popFront(Queue* q)
+{
+    Node* to_dequeue;
+    if (q->flows)
+    {
+        //fair queuing - the next client in turn
+        to_dequeue = flowTake(q, q->flows_front, NULL, true);
+        unlinkNode(q, to_dequeue);
+    }
+    else
+    {
         to_dequeue = q->front;
         if (q->size > 1) 
         {
@@ -161,8 +423,28 @@ Node* dequeue(Queue* q, bool is_critical)
             q->front = NULL;
             q->rear = NULL;
         }
+    }
 
-        q->size--;
+    q->size--;
+    publishSize(q);
+    return to_dequeue;
+}
+
+Node* dequeue(Queue* q, bool is_critical) 
+{
+    if (q)
+    {
+        if (is_critical)
+        {
+            pthread_mutex_lock(&q->global_lock);
+        }
+        Node* to_dequeue;
+        while (isEmpty(q)) 
+        {
+            pthread_cond_wait(&q->deletion_allowed, &q->global_lock);
+        }
+        //queue not empty, can dequeue
+        to_dequeue = popFront(q);
         pthread_cond_signal(&q->insertion_allowed);
         if (q->size == 0)
         {
@@ -178,6 +460,109 @@ Node* dequeue(Queue* q, bool is_critical)
     return NULL;
 }
 
+//takes the oldest request of stash st and counts it as active, NULL if the
+//stash is empty. Needs no lock - its owner and thieves race for each slot
+static Node* stashTake(Queue* q, QueueStash* st)
+{
+    Node* taken;
+    for (int i = 0; i < QUEUE_BATCH - 1; i++)
+    {
+        if (__atomic_load_n(&st->nodes[i], __ATOMIC_RELAXED) &&
+            (taken = __atomic_exchange_n(&st->nodes[i], NULL, __ATOMIC_ACQUIRE)))
+        {
+            //active first, so the slot never looks free to insert
+            __atomic_add_fetch(&q->active_requests_num, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&q->stashed_num, 1, __ATOMIC_RELAXED);
+            if (stats_segment)
+            {
+                statsAddShared(&stats_segment->stashed, -1);
+            }
+            return taken;
+        }
+    }
+    return NULL;
+}
+
+//takes a request stashed by another worker that is still busy with its own
+static Node* stashSteal(Queue* q, int index)
+{
+    Node* taken = NULL;
+    for (int i = 1; i < q->pool_size && !taken && __atomic_load_n(&q->stashed_num, __ATOMIC_RELAXED); i++)
+    {
+        taken = stashTake(q, &q->stashes[(index + i) % q->pool_size]);
+    }
+    return taken;
+}
+
+//
+// Takes the next request for worker index and counts it as active.
+// Stashed requests come first, they left the queue before the waiting ones -
+// those of the worker, then those of the others, so none waits behind a slow
+// request while a worker is idle. Otherwise the worker takes up to its share of
+// the queue, ceil(size / pool_size) capped at QUEUE_BATCH, in one critical section:
+// one to serve and the rest to its stash, unless other workers are idle.
+// If block is set, waits while there is no request, otherwise returns NULL
+//
+Node* dequeueNext(Queue* q, int index, bool block)
+{
+    Node* to_dequeue = NULL;
+    QueueStash* own;
+    int share, stashed;
+
+    if (!q)
+    {
+        return NULL;
+    }
+    own = &q->stashes[index];
+    while (!(to_dequeue = stashTake(q, own)) && !(to_dequeue = stashSteal(q, index)))
+    {
+        //critical section
+        pthread_mutex_lock(&q->global_lock);
+        while (block && isEmpty(q) && !__atomic_load_n(&q->stashed_num, __ATOMIC_RELAXED))
+        {
+            q->idle_workers++;
+            pthread_cond_wait(&q->deletion_allowed, &q->global_lock);
+            q->idle_workers--;
+        }
+        if (!isEmpty(q))
+        {
+            share = q->idle_workers ? 1 : (q->size + q->pool_size - 1) / q->pool_size;
+            share = share < QUEUE_BATCH ? share : QUEUE_BATCH;
+            to_dequeue = popFront(q);
+            __atomic_add_fetch(&q->active_requests_num, 1, __ATOMIC_RELAXED);
+            //the own stash is empty, no other worker fills it
+            for (stashed = 0; stashed < share - 1 && !isEmpty(q); stashed++)
+            {
+                __atomic_store_n(&own->nodes[stashed], popFront(q), __ATOMIC_RELEASE);
+            }
+            if (stashed > 0)
+            {
+                __atomic_add_fetch(&q->stashed_num, stashed, __ATOMIC_RELAXED);
+                if (stats_segment)
+                {
+                    statsAddShared(&stats_segment->stashed, stashed);
+                }
+            }
+            pthread_mutex_unlock(&q->global_lock);
+            break;
+        }
+        stashed = __atomic_load_n(&q->stashed_num, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&q->global_lock);
+        if (!stashed)
+        {
+            return NULL;
+        }
+        //stashed requests that are being taken right now - look again
+        sched_yield();
+    }
+    if (stats_segment)
+    {
+        statsAddShared(&stats_segment->dispatched, 1);
+    }
+    return to_dequeue;
+}
+
+
 bool cond_dequeue(Queue* q, int index)
 {
     if (!q || q->size == 0 || index < 0)
@@ -219,9 +604,7 @@ bool cond_dequeue(Queue* q, int index)
         q->rear = NULL;
     }
     q->size--;
-    Close(to_dequeue->data->connfd);
-    free(to_dequeue->data);
-    free(to_dequeue);
+    dropNode(to_dequeue);
     return true;
 }
 
@@ -246,6 +629,21 @@ void freeQueue(Queue* q)
             free(to_free);
             to_free = temp;
         }
+        for (int i = 0; i < q->pool_size; i++)
+        {
+            for (int j = 0; j < QUEUE_BATCH - 1; j++)
+            {
+                free(q->stashes[i].nodes[j]);
+            }
+        }
+        free(q->stashes);
+        while (q->flows_front)
+        {
+            Flow* temp = q->flows_front->next;
+            free(q->flows_front);
+            q->flows_front = temp;
+        }
+        free(q->flows);
         free(q->schedalg);
         free(q);
     }
@@ -6,6 +6,33 @@
 #include "request.h"
 #include "thread.h"
 
+/* hash table size for the clients with waiting requests, fair queuing only */
+#define QUEUE_FLOW_BUCKETS 256
+/* most requests a worker takes off the queue under one lock acquisition */
+#define QUEUE_BATCH 8
+
+/* QueueStash struct definition - requests a worker took off the queue along with
+   the one it serves, on a cache line of their own. The worker and idle workers
+   stealing take them without the queue lock, by atomic exchange of a slot */
+typedef struct QueueStash
+{
+    Node* nodes[QUEUE_BATCH - 1];
+} __attribute__((aligned(64))) QueueStash;
+
+/* Flow struct definition - the waiting requests of one client, fair queuing only */
+typedef struct Flow
+{
+    uint32_t client_addr;
+    //requests of this client in arrival order, linked through flow_next
+    Node* front;
+    Node* rear;
+    int size;
+    //next flow in the same hash bucket
+    struct Flow* hash_next;
+    //next flow to be served
+    struct Flow* next;
+} Flow;
+
 /* Queue struct definition */
 typedef struct Queue 
 {
@@ -21,8 +48,14 @@ typedef struct Queue
     int http_connections_num;
     // full queue handling method
     char* schedalg;
-    //number of requests currently handled by some worker thread
+    //number of requests currently handled by some worker thread (atomic)
     int active_requests_num;
+    //requests in the stashes of the workers, off the queue but not started yet (atomic)
+    int stashed_num;
+    //a stash per worker
+    QueueStash* stashes;
+    //workers waiting for requests, none get stashed while there are any
+    int idle_workers;
     //max queue size when scheduling algorithm is dynamic, -1 otherwise
     int max_size;
     //queue lock
@@ -33,6 +66,10 @@ typedef struct Queue
     pthread_cond_t deletion_allowed;
     //queue is empty
     pthread_cond_t is_empty;
+    //schedalg "fq" - clients with waiting requests, served round robin
+    Flow** flows;
+    Flow* flows_front;
+    Flow* flows_rear;
 } Queue;
 
 /* Queue mathods */
@@ -40,7 +77,9 @@ Queue* makeQueue(int pool_size, int http_connections_num, char* schedalg, int ma
     pthread_mutex_t global_lock, pthread_cond_t insertion_allowed,
     pthread_cond_t deletion_allowed, pthread_cond_t is_empty);
 bool enqueue(Queue* q, Node* to_insert);
+int enqueueBatch(Queue* q, Node** to_insert, int n);
 Node* dequeue(Queue* q, bool is_critical);
+Node* dequeueNext(Queue* q, int index, bool block);
 bool cond_dequeue(Queue* q, int index);
 bool isEmpty(Queue* q);
 bool isFull(Queue* q, int size);
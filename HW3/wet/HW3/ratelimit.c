@@ -0,0 +1,147 @@
+//
+// ratelimit.c: Per client address token buckets.
+// A connection takes one token from the bucket of its address; buckets refill
+// at RATELIMIT_RATE tokens per second up to RATELIMIT_BURST. An address whose
+// bucket is empty is refused before it reaches the queue, so a single client
+// cannot fill it for everyone else.
+//
+
+#include "ratelimit.h"
+
+RateLimiter* rate_limiter;
+
+/* RateLimiter mathods implementation */
+
+static unsigned hashAddr(uint32_t addr)
+{
+    return (addr * 2654435761u) >> 8;
+}
+
+//adds the tokens earned since the last refill, as of now
+static void refill(TokenBucket* b, struct timeval* now)
+{
+    struct timeval diff;
+
+    timersub(now, &b->refilled, &diff);
+    b->tokens += (diff.tv_sec + diff.tv_usec / 1e6) * RATELIMIT_RATE;
+    if (b->tokens > RATELIMIT_BURST)
+    {
+        b->tokens = RATELIMIT_BURST;
+    }
+    b->refilled = *now;
+}
+
+//forgets the clients whose buckets have filled up again - they are the same as new ones
+static void sweep(RateLimitShard* shard, struct timeval* now)
+{
+    for (int i = 0; i < RATELIMIT_BUCKETS; i++)
+    {
+        TokenBucket** link = &shard->buckets[i];
+        while (*link)
+        {
+            TokenBucket* b = *link;
+            refill(b, now);
+            if (b->tokens >= RATELIMIT_BURST)
+            {
+                *link = b->next;
+                free(b);
+                shard->size--;
+            }
+            else
+            {
+                link = &b->next;
+            }
+        }
+    }
+}
+
+RateLimiter* makeRateLimiter()
+{
+    RateLimiter* rl = (RateLimiter*)calloc(1, sizeof(RateLimiter));
+    if (!rl)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    for (int i = 0; i < RATELIMIT_SHARDS; i++)
+    {
+        pthread_mutex_init(&rl->shards[i].lock, NULL);
+    }
+    return rl;
+}
+
+//
+// Takes a token for a new connection from addr (network byte order).
+// Returns false if the client is over its rate and should be refused
+//
+bool rateLimitAllow(RateLimiter* rl, uint32_t addr)
+{
+    unsigned hash = hashAddr(addr);
+    RateLimitShard* shard;
+    TokenBucket* b;
+    struct timeval now;
+    bool allowed = true;
+
+    if (!rl)
+    {
+        return true;
+    }
+    shard = &rl->shards[hash % RATELIMIT_SHARDS];
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&shard->lock);
+    for (b = shard->buckets[(hash / RATELIMIT_SHARDS) % RATELIMIT_BUCKETS]; b && b->addr != addr; b = b->next)
+        ;
+    if (!b)
+    {
+        if (shard->size >= RATELIMIT_SHARD_ENTRIES)
+        {
+            sweep(shard, &now);
+        }
+        //still full of active clients - let the new one in untracked
+        if (shard->size >= RATELIMIT_SHARD_ENTRIES || !(b = (TokenBucket*)malloc(sizeof(TokenBucket))))
+        {
+            pthread_mutex_unlock(&shard->lock);
+            return true;
+        }
+        b->addr = addr;
+        b->tokens = RATELIMIT_BURST;
+        b->refilled = now;
+        b->next = shard->buckets[(hash / RATELIMIT_SHARDS) % RATELIMIT_BUCKETS];
+        shard->buckets[(hash / RATELIMIT_SHARDS) % RATELIMIT_BUCKETS] = b;
+        shard->size++;
+    }
+    refill(b, &now);
+    if (b->tokens >= 1)
+    {
+        b->tokens--;
+    }
+    else
+    {
+        allowed = false;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return allowed;
+}
+
+void freeRateLimiter(RateLimiter* rl)
+{
+    if (rl)
+    {
+        for (int i = 0; i < RATELIMIT_SHARDS; i++)
+        {
+            for (int j = 0; j < RATELIMIT_BUCKETS; j++)
+            {
+                TokenBucket* b = rl->shards[i].buckets[j];
+                while (b)
+                {
+                    TokenBucket* temp = b->next;
+                    free(b);
+                    b = temp;
+                }
+            }
+            pthread_mutex_destroy(&rl->shards[i].lock);
+        }
+        free(rl);
+    }
+}
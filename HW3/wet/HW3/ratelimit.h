@@ -0,0 +1,49 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "segel.h"
+
+/* every client address may open RATELIMIT_RATE connections per second on average,
+   and up to RATELIMIT_BURST at once */
+#define RATELIMIT_RATE 200
+#define RATELIMIT_BURST 400
+/* the table is split into independently locked shards */
+#define RATELIMIT_SHARDS 16
+#define RATELIMIT_BUCKETS 256
+/* most clients a shard tracks, idle clients are forgotten first */
+#define RATELIMIT_SHARD_ENTRIES 4096
+
+/* TokenBucket struct definition - the allowance of one client address */
+typedef struct TokenBucket
+{
+    uint32_t addr;
+    double tokens;
+    struct timeval refilled;
+    struct TokenBucket* next;
+} TokenBucket;
+
+/* RateLimitShard struct definition */
+typedef struct RateLimitShard
+{
+    pthread_mutex_t lock;
+    TokenBucket* buckets[RATELIMIT_BUCKETS];
+    int size;
+} RateLimitShard;
+
+/* RateLimiter struct definition */
+typedef struct RateLimiter
+{
+    RateLimitShard shards[RATELIMIT_SHARDS];
+} RateLimiter;
+
+/* RateLimiter mathods */
+RateLimiter* makeRateLimiter();
+bool rateLimitAllow(RateLimiter* rl, uint32_t addr);
+void freeRateLimiter(RateLimiter* rl);
+
+/* global vars */
+extern RateLimiter* rate_limiter;
+
+#endif //RATELIMIT_H
@@ -2,12 +2,61 @@
 // request.c: Does the bulk of the work for the web server.
 // 
 
+#define _GNU_SOURCE
+
 #include "segel.h"
 #include "request.h"
 #include "thread.h"
+#include "compress.h"
+#include "mime.h"
+#include "accesslog.h"
+#include "parser.h"
+#include "transport.h"
+#include <sys/syscall.h>
+#include <stdarg.h>
 
 /* Request mathods implementation */
 
+//
+// Writes n bytes to the client, through the transport of the request.
+// Unlike Rio_writen, a failed write does not take the server down - a client
+// that stops reading runs into SO_SNDTIMEO and is evicted.
+// Returns 0 on success, -1 otherwise.
+//
+static int requestWrite(int fd, void* buf, size_t n, int id)
+{
+    if (transportWriten(requests[id]->transport, buf, n) == n)
+    {
+        requests[id]->bytes_sent += n;
+        return 0;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT)
+    {
+        statInc(&threads_handler[id]->stat_thread_timeouts);
+    }
+    return -1;
+}
+
+//
+// Like requestWrite, for a response split over iovcnt buffers, which go out
+// together. Returns 0 on success, -1 otherwise.
+//
+static int requestWritev(struct iovec* iov, int iovcnt, int id)
+{
+    ssize_t n;
+
+    if ((n = transportWritevn(requests[id]->transport, iov, iovcnt)) >= 0)
+    {
+        requests[id]->bytes_sent += n;
+        return 0;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT)
+    {
+        statInc(&threads_handler[id]->stat_thread_timeouts);
+    }
+    return -1;
+}
+
 Request* makeRequest(int connfd) 
 {
     Request* r = (Request*)malloc(sizeof(Request));
@@ -19,11 +68,25 @@ Request* makeRequest(int connfd)
     //set time of arrival to now
     gettimeofday(&r->stat_req_arrival, NULL);
     r->connfd = connfd;
+    r->client_addr = 0;
+    r->transport = NULL;
+    r->accept_gzip = false;
+    r->accept_br = false;
+    r->if_none_match[0] = '\0';
+    r->if_modified_since = 0;
+    r->has_range = false;
+    r->status = 0;
+    r->bytes_sent = 0;
+    r->method[0] = '\0';
+    r->uri[0] = '\0';
     return r;
 }
 
-// requestError(      fd,    filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
-void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, int id)
+//
+// requestError with extra header lines (each ending in \r\n) added to the
+// response, e.g. the Content-Range a 416 has to carry
+//
+static void requestErrorHeaders(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, char *headers, int id)
 {
     char buf[MAXLINE], body[MAXBUF];
     
@@ -36,83 +99,218 @@ void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longm
 
     // Write out the header information for this response
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    printf("%s", buf);
-
-    sprintf(buf, "Content-Type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    printf("%s", buf);
-
-    sprintf(buf, "Content-Length: %lu\r\n", strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    printf("%s", buf);
+    requests[id]->status = atoi(errnum);
+    sprintf(buf, "%sContent-Type: text/html\r\n", buf);
+    sprintf(buf, "%sContent-Length: %lu\r\n", buf, strlen(body));
+    sprintf(buf, "%s%s", buf, headers);
 
     // All requests (including errors) increment the request counter.
-    memset(buf, 0, sizeof(buf));
     //paste here Segel printing format
     sprintf(buf, "%sStat-Req-Arrival:: %lu.%06lu\r\n", buf, requests[id]->stat_req_arrival.tv_sec, requests[id]->stat_req_arrival.tv_usec);
     sprintf(buf, "%sStat-Req-Dispatch:: %lu.%06lu\r\n", buf, requests[id]->stat_req_dispatch.tv_sec, requests[id]->stat_req_dispatch.tv_usec);
     sprintf(buf, "%sStat-Thread-Id:: %d\r\n", buf, threads_handler[id]->stat_thread_id);
-    sprintf(buf, "%sStat-Thread-Count:: %d\r\n", buf, ++threads_handler[id]->stat_thread_count);
+    sprintf(buf, "%sStat-Thread-Count:: %d\r\n", buf, statInc(&threads_handler[id]->stat_thread_count));
     sprintf(buf, "%sStat-Thread-Static:: %d\r\n", buf, threads_handler[id]->stat_thread_static);
     sprintf(buf, "%sStat-Thread-Dynamic:: %d\r\n\r\n", buf, threads_handler[id]->stat_thread_dynamic);
-    Rio_writen(fd, buf, strlen(buf));
-    printf("%s", buf);
 
-    // Write out the content
-    Rio_writen(fd, body, strlen(body));
-    printf("%s", body);
+    // Write out the header information and the content
+    struct iovec iov[2] = { { buf, strlen(buf) }, { body, strlen(body) } };
+    requestWritev(iov, 2, id);
 
 }
 
+// requestError(      fd,    filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
+void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, int id)
+{
+    requestErrorHeaders(fd, cause, errnum, shortmsg, longmsg, "", id);
+}
+
 
 //
-// Reads and discards everything up to an empty text line
+// Parses an Accept-Encoding header value into r.
+// Codings the client lists with q=0 are treated as refused
 //
-void requestReadhdrs(rio_t *rp)
+static void requestParseAcceptEncoding(char *value, Request *r)
 {
-    char buf[MAXLINE];
+    char *token, *saveptr, *q;
+    size_t len;
+    bool accepted;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while (strcmp(buf, "\r\n")) {
-        Rio_readlineb(rp, buf, MAXLINE);
+    for (token = strtok_r(value, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+        while (isspace(*token)) {
+            token++;
+        }
+        len = strcspn(token, " \t;\r\n");
+        q = strchr(token, ';') ? strstr(strchr(token, ';'), "q=") : NULL;
+        accepted = !q || atof(q + 2) > 0;
+        if (len == 4 && !strncasecmp(token, "gzip", len)) {
+            r->accept_gzip = accepted;
+        }
+        else if (len == 2 && !strncasecmp(token, "br", len)) {
+            r->accept_br = accepted;
+        }
     }
-    return;
 }
 
 //
-// Return 1 if static, 0 if dynamic content
-// Calculates filename (and cgiargs, for dynamic) from uri
+// Parses a Range header value into r. Only a single byte range is
+// supported, anything else is ignored and the whole file is served
 //
-int requestParseURI(char *uri, char *filename, char *cgiargs) 
+static void requestParseRange(char *value, Request *r)
 {
-    char *ptr;
+    char *end;
+    off_t first = -1, last = -1;
 
-    if (strstr(uri, "..")) {
+    while (isspace(*value)) {
+        value++;
+    }
+    if (strncasecmp(value, "bytes=", 6) || strchr(value, ',')) {
+        return;
+    }
+    value += 6;
+    if (isdigit(*value)) {
+        first = strtoll(value, &end, 10);
+        value = end;
+    }
+    if (*value++ != '-') {
+        return;
+    }
+    if (isdigit(*value)) {
+        last = strtoll(value, &end, 10);
+    }
+    else if (first < 0) {
+        return;
+    }
+    if (first >= 0 && last >= 0 && last < first) {
+        return;
+    }
+    r->range_start = first;
+    r->range_end = last;
+    r->has_range = true;
+}
+
+//
+// Resolves the byte range of r against a representation of filesize bytes.
+// A missing range_start asks for the last range_end bytes.
+// Returns false if the range cannot be satisfied
+//
+static bool requestResolveRange(Request *r, off_t filesize, off_t *start, off_t *length)
+{
+    off_t first = r->range_start, last = r->range_end;
+
+    if (first < 0) {
+        first = last < filesize ? filesize - last : 0;
+        last = filesize - 1;
+    }
+    else if (last < 0 || last >= filesize) {
+        last = filesize - 1;
+    }
+    if (first >= filesize || first > last) {
+        return false;
+    }
+    *start = first;
+    *length = last - first + 1;
+    return true;
+}
+
+//
+// Returns true if etag is listed in an If-None-Match header value.
+// Entity tags are compared weakly, as RFC 7232 requires for this header
+//
+static bool requestEtagMatch(char *list, char *etag)
+{
+    size_t len = strlen(etag);
+
+    while (*list) {
+        while (isspace(*list) || *list == ',') {
+            list++;
+        }
+        if (*list == '*') {
+            return true;
+        }
+        if (!strncmp(list, "W/", 2)) {
+            list += 2;
+        }
+        if (!strncmp(list, etag, len) && (!list[len] || list[len] == ',' || isspace(list[len]))) {
+            return true;
+        }
+        list += strcspn(list, ",");
+    }
+    return false;
+}
+
+//
+// Returns true if the copy the client already holds, identified by its
+// If-None-Match or If-Modified-Since header, is still current
+//
+static bool requestNotModified(Request *r, struct stat *sbuf, char *etag)
+{
+    if (r->if_none_match[0]) {
+        return requestEtagMatch(r->if_none_match, etag);
+    }
+    return r->if_modified_since && sbuf->st_mtime <= r->if_modified_since;
+}
+
+//
+// Records the header fields r needs from the parsed request head
+//
+void requestReadhdrs(RequestHead *head, Request *r)
+{
+    struct tm tm;
+
+    for (int i = 0; i < head->headers_num; i++) {
+        char *name = head->headers[i].name.data, *value = head->headers[i].value.data;
+
+        if (!strcasecmp(name, "Accept-Encoding")) {
+            requestParseAcceptEncoding(value, r);
+        }
+        else if (!strcasecmp(name, "If-None-Match")) {
+            snprintf(r->if_none_match, sizeof(r->if_none_match), "%s", value);
+        }
+        else if (!strcasecmp(name, "If-Modified-Since")) {
+            if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+                r->if_modified_since = timegm(&tm);
+            }
+        }
+        else if (!strcasecmp(name, "Range")) {
+            requestParseRange(value, r);
+        }
+    }
+}
+
+//
+// Return 1 if static, 0 if dynamic content, -1 if the path cannot be decoded
+// into a filename of at most MAXLINE bytes.
+// Calculates filename (and cgiargs, for dynamic) from the request path and query.
+// cgiargs points into the request head
+//
+int requestParseURI(RequestHead *head, char *filename, char **cgiargs)
+{
+    size_t prefix = strlen("./public");
+
+    strcpy(filename, "./public");
+    if (head->path.data[0] != '/' ||
+        percentDecode(&head->path, filename + prefix, MAXLINE - prefix - strlen("home.html")) < 0) {
+        return -1;
+    }
+
+    if (strstr(filename, "..")) {
         sprintf(filename, "./public/home.html");
+        *cgiargs = "";
         return 1;
     }
 
-    if (!strstr(uri, "cgi")) {
+    if (!strstr(filename, "cgi")) {
         // static
-        strcpy(cgiargs, "");
-        sprintf(filename, "./public/%s", uri);
-        if (uri[strlen(uri) - 1] == '/') {
+        *cgiargs = "";
+        if (filename[strlen(filename) - 1] == '/') {
             strcat(filename, "home.html");
         }
         return 1;
     }
     else {
         // dynamic
-        ptr = index(uri, '?');
-        if (ptr) {
-            strcpy(cgiargs, ptr + 1);
-            *ptr = '\0';
-        }
-        else {
-            strcpy(cgiargs, "");
-        }
-        sprintf(filename, "./public/%s", uri);
+        *cgiargs = head->query.data;
         return 0;
     }
 }
@@ -122,14 +320,60 @@ int requestParseURI(char *uri, char *filename, char *cgiargs)
 //
 void requestGetFiletype(char *filename, char *filetype)
 {
-    if (strstr(filename, ".html"))
-        strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-        strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg"))
-        strcpy(filetype, "image/jpeg");
-    else
-        strcpy(filetype, "text/plain");
+    char *type = mimeLookup(filename);
+
+    strcpy(filetype, type ? type : "text/plain");
+}
+
+//
+// Waits for the CGI child to exit. Under a coroutine event loop only this
+// connection waits, on a pidfd, instead of the whole worker thread. A child
+// still running at the deadline is killed, the waitpid that reaps it would
+// otherwise block every connection of the worker
+//
+static void requestWaitChild(pid_t pid)
+{
+    struct timeval deadline;
+    int pidfd;
+
+    if (rio_wait_hook && (pidfd = syscall(SYS_pidfd_open, pid, 0)) >= 0) {
+        gettimeofday(&deadline, NULL);
+        deadline.tv_sec += REQUEST_CGI_TIMEOUT;
+        if (rio_wait_hook(pidfd, POLLIN, &deadline) < 0) {
+            kill(pid, SIGKILL);
+        }
+        close(pidfd);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+//
+// Passes what the CGI program writes to out on to the client, until the
+// program closes it. Used when the client cannot get the bytes straight
+// from the program - a TLS session has to encrypt them.
+//
+static void requestRelay(int fd, int out, int id)
+{
+    char buf[MAXBUF];
+    struct timeval deadline;
+    ssize_t n;
+
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += REQUEST_CGI_TIMEOUT;
+    if (rio_wait_hook) {
+        fcntl(out, F_SETFL, fcntl(out, F_GETFL) | O_NONBLOCK);
+    }
+    while ((n = read(out, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN && !rio_wait_hook(out, POLLIN, &deadline)) {
+            continue;
+        }
+        if (n < 0 || requestWrite(fd, buf, n, id)) {
+            return;
+        }
+    }
 }
 
 void requestServeDynamic(int fd, char *filename, char *cgiargs, int id)
@@ -139,6 +383,7 @@ void requestServeDynamic(int fd, char *filename, char *cgiargs, int id)
     // The server does only a little bit of the header.  
     // The CGI script has to finish writing out the header.
     sprintf(buf, "HTTP/1.0 200 OK\r\n");
+    requests[id]->status = 200;
     sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
 
     // All requests (including errors) increment the request counter.
@@ -147,12 +392,23 @@ void requestServeDynamic(int fd, char *filename, char *cgiargs, int id)
     sprintf(buf, "%sStat-Req-Arrival:: %lu.%06lu\r\n", buf, requests[id]->stat_req_arrival.tv_sec, requests[id]->stat_req_arrival.tv_usec);
     sprintf(buf, "%sStat-Req-Dispatch:: %lu.%06lu\r\n", buf, requests[id]->stat_req_dispatch.tv_sec, requests[id]->stat_req_dispatch.tv_usec);
     sprintf(buf, "%sStat-Thread-Id:: %d\r\n", buf, threads_handler[id]->stat_thread_id);
-    sprintf(buf, "%sStat-Thread-Count:: %d\r\n", buf, ++threads_handler[id]->stat_thread_count);
+    sprintf(buf, "%sStat-Thread-Count:: %d\r\n", buf, statInc(&threads_handler[id]->stat_thread_count));
     sprintf(buf, "%sStat-Thread-Static:: %d\r\n", buf, threads_handler[id]->stat_thread_static);
-    sprintf(buf, "%sStat-Thread-Dynamic:: %d\r\n", buf, ++threads_handler[id]->stat_thread_dynamic);
+    sprintf(buf, "%sStat-Thread-Dynamic:: %d\r\n", buf, statInc(&threads_handler[id]->stat_thread_dynamic));
 
 
-    Rio_writen(fd, buf, strlen(buf));
+    if (requestWrite(fd, buf, strlen(buf), id))
+    {
+        return;
+    }
+
+    // Over TLS the output of the CGI program comes back through a pipe, to be
+    // encrypted on its way to the client
+    int out[2] = { -1, fd };
+    if (requests[id]->transport->ssl && pipe2(out, O_CLOEXEC) < 0)
+    {
+        return;
+    }
 
     //save son pid!
     pid_t pid = Fork();
@@ -161,92 +417,301 @@ void requestServeDynamic(int fd, char *filename, char *cgiargs, int id)
         /* Child process */
         Setenv("QUERY_STRING", cgiargs, 1);
         /* When the CGI process writes to stdout, it will instead go to the socket */
-        Dup2(fd, STDOUT_FILENO);
+        /* (which CGI programs expect to block) */
+        fcntl(out[1], F_SETFL, fcntl(out[1], F_GETFL) & ~O_NONBLOCK);
+        Dup2(out[1], STDOUT_FILENO);
         Execve(filename, emptylist, environ);
     }
     else
     {
-        waitpid(pid, NULL, 0);
+        if (out[0] >= 0)
+        {
+            Close(out[1]);
+            requestRelay(fd, out[0], id);
+            Close(out[0]);
+        }
+        requestWaitChild(pid);
     }
     //change to waitpid
     //Wait(NULL);
 }
 
 
-void requestServeStatic(int fd, char* filename, int filesize, int id)
+//
+// Looks for a precompressed sibling of filename (filename + suffix).
+// Returns its open file cache entry if a readable one exists, NULL otherwise
+//
+static FdEntry *requestFindEncoded(char *filename, char *suffix)
+{
+    char encoded[MAXLINE];
+    FdEntry *e;
+
+    if (strlen(filename) + strlen(suffix) >= MAXLINE) {
+        return NULL;
+    }
+    snprintf(encoded, sizeof(encoded), "%s%s", filename, suffix);
+    if ((e = fdCacheGet(fd_cache, encoded)) && e->fd >= 0 &&
+        S_ISREG(e->sbuf.st_mode) && (S_IRUSR & e->sbuf.st_mode)) {
+        return e;
+    }
+    fdCacheRelease(fd_cache, e);
+    return NULL;
+}
+
+//
+// Appends to the header being put together in buf (size bytes), *n is its
+// length so far. Once a line does not fit *n stays at size, so the caller
+// checks for truncation once at the end
+//
+static void requestHeaderAppend(char *buf, size_t size, size_t *n, const char *fmt, ...)
+{
+    va_list ap;
+    int rc;
+
+    if (*n >= size) {
+        return;
+    }
+    va_start(ap, fmt);
+    rc = vsnprintf(buf + *n, size - *n, fmt, ap);
+    va_end(ap);
+    *n = (rc < 0 || (size_t)rc >= size - *n) ? size : *n + rc;
+}
+
+//
+// Writes the header (head_len bytes of head), then length bytes of srcfd,
+// starting at offset start, to the client. The kernel copies straight from the
+// page cache (over TLS, only with kTLS) and the file offset of srcfd is left
+// untouched, so workers can share the descriptor. Where the transport can link
+// the header to the file (io_uring), both go out in one submission.
+// Returns 0 on success, -1 otherwise
+//
+static int requestSendfile(int fd, void *head, size_t head_len, int srcfd, off_t start, off_t length, int id)
+{
+    Transport* t = requests[id]->transport;
+    struct iovec iov = { head, head_len };
+    ssize_t n;
+
+    if (!t->ops->sendfilev || length == 0) {
+        if (requestWrite(fd, head, head_len, id)) {
+            return -1;
+        }
+        iov.iov_len = 0;
+    }
+    while (length > 0) {
+        n = iov.iov_len ? t->ops->sendfilev(t, &iov, 1, srcfd, &start, length) : t->ops->sendfile(t, srcfd, &start, length);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && rio_wait_hook &&
+                !rio_wait_hook(fd, POLLOUT, NULL)) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT)) {
+                statInc(&threads_handler[id]->stat_thread_timeouts);
+            }
+            return -1;
+        }
+        length -= n;
+        requests[id]->bytes_sent += n + iov.iov_len;
+        iov.iov_len = 0;
+    }
+    return 0;
+}
+
+void requestServeStatic(int fd, char* filename, FdEntry* file, int id)
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    char filetype[MAXLINE], buf[MAXBUF];
+    char *encoding = NULL, etag[128], lastmod[64];
+    struct stat *sbuf = &file->sbuf;
+    off_t filesize = sbuf->st_size, start = 0, length;
+    struct tm tm;
+    CompressEntry *gz = NULL;
+    FdEntry *sibling = NULL, *src = file;
+    Request *r = requests[id];
+    bool compressible, partial = false, not_modified;
+    size_t n = 0;
+    char range[64];
 
     requestGetFiletype(filename, filetype);
+    compressible = isCompressible(filetype);
 
-    srcfd = Open(filename, O_RDONLY, 0);
+    // Pick what to send for the client's Accept-Encoding: a precompressed
+    // sibling file, the cached gzip encoding, or the file as is.
+    // Byte ranges always refer to the file as is
+    if (r->has_range) {
+        encoding = NULL;
+    }
+    else if (r->accept_br && (sibling = requestFindEncoded(filename, ".br"))) {
+        encoding = "br";
+    }
+    else if (r->accept_gzip && (sibling = requestFindEncoded(filename, ".gz"))) {
+        encoding = "gzip";
+    }
+    else if (r->accept_gzip && compressible &&
+        (gz = compressCacheGet(compress_cache, filename, file->fd, sbuf))) {
+        encoding = "gzip";
+    }
+    if (gz) {
+        filesize = gz->len;
+    }
+    else if (sibling) {
+        src = sibling;
+        filesize = sibling->sbuf.st_size;
+    }
 
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
+    // validators of the chosen representation
+    sprintf(etag, "\"%lx-%lx-%lx%s%s\"", (unsigned long)sbuf->st_ino, (unsigned long)sbuf->st_size,
+        (unsigned long)sbuf->st_mtime, encoding ? "-" : "", encoding ? encoding : "");
+    strftime(lastmod, sizeof(lastmod), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&sbuf->st_mtime, &tm));
+
+    not_modified = requestNotModified(r, sbuf, etag);
+    length = not_modified ? 0 : filesize;
+    if (!not_modified && r->has_range) {
+        if (!requestResolveRange(r, filesize, &start, &length)) {
+            // tell the client what the valid range is
+            sprintf(range, "Content-Range: bytes */%ld\r\n", (long)filesize);
+            requestErrorHeaders(fd, filename, "416", "Range Not Satisfiable", "OS-HW3 Server cannot serve this range of the file", range, id);
+            return;
+        }
+        partial = true;
+    }
 
     // put together response
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
-    sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-Type: %s\r\n", buf, filetype);
+    if (not_modified) {
+        requestHeaderAppend(buf, sizeof(buf), &n, "HTTP/1.0 304 Not Modified\r\n");
+        r->status = 304;
+        requestHeaderAppend(buf, sizeof(buf), &n, "Server: OS-HW3 Web Server\r\n");
+    }
+    else {
+        requestHeaderAppend(buf, sizeof(buf), &n, partial ? "HTTP/1.0 206 Partial Content\r\n" : "HTTP/1.0 200 OK\r\n");
+        r->status = partial ? 206 : 200;
+        requestHeaderAppend(buf, sizeof(buf), &n, "Server: OS-HW3 Web Server\r\n");
+        requestHeaderAppend(buf, sizeof(buf), &n, "Content-Length: %ld\r\n", (long)length);
+        requestHeaderAppend(buf, sizeof(buf), &n, "Content-Type: %s\r\n", filetype);
+        if (partial) {
+            requestHeaderAppend(buf, sizeof(buf), &n, "Content-Range: bytes %ld-%ld/%ld\r\n", (long)start, (long)(start + length - 1), (long)filesize);
+        }
+    }
+    requestHeaderAppend(buf, sizeof(buf), &n, "Last-Modified: %s\r\n", lastmod);
+    requestHeaderAppend(buf, sizeof(buf), &n, "ETag: %s\r\n", etag);
+    requestHeaderAppend(buf, sizeof(buf), &n, "Accept-Ranges: bytes\r\n");
+    if (encoding) {
+        requestHeaderAppend(buf, sizeof(buf), &n, "Content-Encoding: %s\r\n", encoding);
+    }
+    if (encoding || compressible) {
+        requestHeaderAppend(buf, sizeof(buf), &n, "Vary: Accept-Encoding\r\n");
+    }
 
     // All requests (including errors) increment the request counter
-    // valid static requests increment the static counter
+    // valid static requests increment the static counter. Counted only
+    // once the header fits, a 500 below counts the request by itself
 
     //paste here Segel printing format
-    sprintf(buf, "%sStat-Req-Arrival:: %lu.%06lu\r\n", buf, requests[id]->stat_req_arrival.tv_sec, requests[id]->stat_req_arrival.tv_usec);
-    sprintf(buf, "%sStat-Req-Dispatch:: %lu.%06lu\r\n", buf, requests[id]->stat_req_dispatch.tv_sec, requests[id]->stat_req_dispatch.tv_usec);
-    sprintf(buf, "%sStat-Thread-Id:: %d\r\n", buf, threads_handler[id]->stat_thread_id);
-    sprintf(buf, "%sStat-Thread-Count:: %d\r\n", buf, ++threads_handler[id]->stat_thread_count);
-    sprintf(buf, "%sStat-Thread-Static:: %d\r\n", buf, ++threads_handler[id]->stat_thread_static);
-    sprintf(buf, "%sStat-Thread-Dynamic:: %d\r\n\r\n", buf, threads_handler[id]->stat_thread_dynamic);
-
-
-    Rio_writen(fd, buf, strlen(buf));
-
-    //  Writes out to the client socket the memory-mapped file 
-    Rio_writen(fd, srcp, filesize);
-    Munmap(srcp, filesize);
+    requestHeaderAppend(buf, sizeof(buf), &n, "Stat-Req-Arrival:: %lu.%06lu\r\n", requests[id]->stat_req_arrival.tv_sec, requests[id]->stat_req_arrival.tv_usec);
+    requestHeaderAppend(buf, sizeof(buf), &n, "Stat-Req-Dispatch:: %lu.%06lu\r\n", requests[id]->stat_req_dispatch.tv_sec, requests[id]->stat_req_dispatch.tv_usec);
+    requestHeaderAppend(buf, sizeof(buf), &n, "Stat-Thread-Id:: %d\r\n", threads_handler[id]->stat_thread_id);
+    requestHeaderAppend(buf, sizeof(buf), &n, "Stat-Thread-Count:: %d\r\n", threads_handler[id]->stat_thread_count + 1);
+    requestHeaderAppend(buf, sizeof(buf), &n, "Stat-Thread-Static:: %d\r\n", threads_handler[id]->stat_thread_static + 1);
+    requestHeaderAppend(buf, sizeof(buf), &n, "Stat-Thread-Dynamic:: %d\r\n\r\n", threads_handler[id]->stat_thread_dynamic);
+
+    // a header cut short would mislead the client about the body that follows
+    if (n >= sizeof(buf)) {
+        requestError(fd, filename, "500", "Internal Server Error", "OS-HW3 Server could not put together the response header", id);
+        compressCacheRelease(compress_cache, gz);
+        fdCacheRelease(fd_cache, sibling);
+        return;
+    }
+    statInc(&threads_handler[id]->stat_thread_count);
+    statInc(&threads_handler[id]->stat_thread_static);
+
+    //  Writes out to the client socket the cached encoding, or the file
+    //  straight from the page cache
+    if (gz) {
+        struct iovec iov[2] = { { buf, n }, { gz->data + start, length } };
+        requestWritev(iov, 2, id);
+    }
+    else {
+        requestSendfile(fd, buf, n, src->fd, start, length, id);
+    }
+    compressCacheRelease(compress_cache, gz);
+    fdCacheRelease(fd_cache, sibling);
 
 }
 
-// handle a request
-void requestHandle(int fd, int id)
+// reads, parses and answers a request
+static void requestProcess(int fd, int id)
 {
 
-    int is_static;
+    int is_static, rc;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
+    FdEntry *file = NULL;
+    RequestHead head;
+    char *buf, filename[MAXLINE], *cgiargs;
+    ssize_t n;
     rio_t rio;
 
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    rio_readinit_transport(&rio, requests[id]->transport);
+    gettimeofday(&rio.rio_deadline, NULL);
+    rio.rio_deadline.tv_sec += REQUEST_HEADER_TIMEOUT;
+
+    // the whole request head stays in the rio buffer, and is parsed in place
+    if ((n = rio_readhead(&rio, &buf, REQUEST_MAX_HEADER_BYTES)) <= 0) {
+        if (n < 0 && errno == EMSGSIZE) {
+            statInc(&threads_handler[id]->stat_thread_oversized);
+            if (!memchr(rio.rio_buf, '\n', rio.rio_cnt)) {
+                requestError(fd, "", "414", "URI Too Long", "OS-HW3 Server got a request line that is too long", id);
+            }
+            else {
+                requestError(fd, "", "431", "Request Header Fields Too Large", "OS-HW3 Server got a request head that is too large", id);
+            }
+        }
+        else if (n < 0 && errno == ETIMEDOUT) {
+            statInc(&threads_handler[id]->stat_thread_timeouts);
+        }
+        return;
+    }
+    if ((rc = parseRequestHead(buf, n, &head)) == PARSE_TOO_MANY_HEADERS) {
+        statInc(&threads_handler[id]->stat_thread_oversized);
+        requestError(fd, "", "431", "Request Header Fields Too Large", "OS-HW3 Server got too many header fields", id);
+        return;
+    }
+    if (rc == PARSE_ERROR) {
+        requestError(fd, "", "400", "Bad Request", "OS-HW3 Server could not parse this request", id);
+        return;
+    }
+    strncpy(requests[id]->method, head.method.data, REQUEST_LOG_METHOD_LEN);
+    snprintf(requests[id]->uri, REQUEST_LOG_URI_LEN, head.query.len ? "%s?%s" : "%s", head.path.data, head.query.data);
 
-    printf("%s %s %s\n", method, uri, version);
+    if (strcasecmp(head.method.data, "GET")) {
+        requestError(fd, head.method.data, "501", "Not Implemented", "OS-HW3 Server does not implement this method", id);
+        return;
+    }
+    requestReadhdrs(&head, requests[id]);
 
-    if (strcasecmp(method, "GET")) {
-        requestError(fd, method, "501", "Not Implemented", "OS-HW3 Server does not implement this method", id);
+    if ((is_static = requestParseURI(&head, filename, &cgiargs)) < 0) {
+        requestError(fd, "", "400", "Bad Request", "OS-HW3 Server could not decode this URI", id);
         return;
     }
-    requestReadhdrs(&rio);
 
-    is_static = requestParseURI(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
+    // static files come from the open file cache, which also holds their stat data
+    if (is_static && (file = fdCacheGet(fd_cache, filename)) && file->fd >= 0) {
+        sbuf = file->sbuf;
+    }
+    else if (stat(filename, &sbuf) < 0) {
+        fdCacheRelease(fd_cache, file);
         requestError(fd, filename, "404", "Not found", "OS-HW3 Server could not find this file", id);
         return;
     }
 
     if (is_static) {
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+        if (!file || file->fd < 0 || !(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+            fdCacheRelease(fd_cache, file);
             requestError(fd, filename, "403", "Forbidden", "OS-HW3 Server could not read this file", id);
             return;
         }
-        requestServeStatic(fd, filename, sbuf.st_size, id);
+        requestServeStatic(fd, filename, file, id);
+        fdCacheRelease(fd_cache, file);
     }
     else {
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
@@ -257,3 +722,21 @@ void requestHandle(int fd, int id)
     }
 }
 
+// handle a request, then record it in the access log
+void requestHandle(int fd, int id)
+{
+    struct timeval write_timeout = { REQUEST_WRITE_TIMEOUT, 0 }, deadline;
+    Transport transport;
+
+    // bound how long a slow client may hold this worker
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += REQUEST_HEADER_TIMEOUT;
+    if (!transportOpen(&transport, fd, &deadline, &write_timeout))
+    {
+        requests[id]->transport = &transport;
+        requestProcess(fd, id);
+        transportClose(&transport);
+        requests[id]->transport = NULL;
+    }
+    accessLogAppend(access_log, id, requests[id]);
+}
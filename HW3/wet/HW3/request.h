@@ -1,7 +1,26 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "segel.h"
+#include "fdcache.h"
+#include "parser.h"
+#include "transport.h"
+
+/* connection limits - a client has REQUEST_HEADER_TIMEOUT seconds to deliver the
+   whole request head, which may not exceed REQUEST_MAX_HEADER_BYTES (at most
+   RIO_BUFSIZE, the head is parsed inside the rio buffer), and each
+   response write may stall for at most REQUEST_WRITE_TIMEOUT seconds */
+#define REQUEST_HEADER_TIMEOUT 10
+#define REQUEST_WRITE_TIMEOUT 10
+#define REQUEST_MAX_HEADER_BYTES 16384
+/* longest a connection waits for its CGI program without blocking the worker (seconds) */
+#define REQUEST_CGI_TIMEOUT 300
+
+/* how much of the method and uri the access log keeps */
+#define REQUEST_LOG_METHOD_LEN 8
+#define REQUEST_LOG_URI_LEN 96
 
 /* request struct definition */
 typedef struct Request
@@ -12,16 +31,36 @@ typedef struct Request
     struct timeval stat_req_dispatch;
     //request connection decsiptor
     int connfd;
+    //client IPv4 address, network byte order
+    uint32_t client_addr;
+    //what the response goes out through while the request is handled, NULL otherwise
+    Transport* transport;
+    //content encodings the client accepts (Accept-Encoding header)
+    bool accept_gzip;
+    bool accept_br;
+    //conditional GET validators, empty / 0 if not sent
+    char if_none_match[256];
+    time_t if_modified_since;
+    //single byte range (Range header), a bound is -1 if not given
+    bool has_range;
+    off_t range_start;
+    off_t range_end;
+    //what the access log records - response status (0 if none was sent), bytes
+    //written to the client, and the (truncated) request line
+    int status;
+    off_t bytes_sent;
+    char method[REQUEST_LOG_METHOD_LEN];
+    char uri[REQUEST_LOG_URI_LEN];
 } Request;
 
 /* Request mathods */
 Request* makeRequest(int connfd);
 void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg, int id);
-void requestReadhdrs(rio_t *rp);
-int requestParseURI(char *uri, char *filename, char *cgiargs);
+void requestReadhdrs(RequestHead *head, Request* r);
+int requestParseURI(RequestHead *head, char *filename, char **cgiargs);
 void requestGetFiletype(char *filename, char *filetype);
 void requestServeDynamic(int fd, char *filename, char *cgiargs, int id);
-void requestServeStatic(int fd, char *filename, int filesize, int thread_id);
+void requestServeStatic(int fd, char *filename, FdEntry *file, int id);
 void requestHandle(int fd, int id);
 
 /* global vars */
@@ -1,6 +1,17 @@
 #include "scheduler.h"
 #include "request.h"
 #include "thread.h"
+#include "ratelimit.h"
+#include "shmstats.h"
+#include "transport.h"
+#include "accesslog.h"
+
+//answer to a client over its rate, sent without waiting on the socket
+static const char too_many_requests[] =
+    "HTTP/1.0 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+//answer to a request that waited in the queue for too long
+static const char service_unavailable[] =
+    "HTTP/1.0 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
 
 /* Scheduler mathods implementation */
 Scheduler* makeScheduler(int pool_size, int http_connections_num, char* schedalg, int max_size,
@@ -33,6 +44,7 @@ Scheduler* makeScheduler(int pool_size, int http_connections_num, char* schedalg
     }
     strcpy(s->schedalg, schedalg);
     s->max_size = max_size;
+    s->max_sojourn_ms = SCHED_MAX_SOJOURN_MS;
     s->global_lock = global_lock;
     s->insertion_allowed = insertion_allowed;
     s->deletion_allowed = deletion_allowed;
@@ -40,56 +52,212 @@ Scheduler* makeScheduler(int pool_size, int http_connections_num, char* schedalg
     return s;
 }
 
-void request(Scheduler* s, int connfd) 
+//
+// Makes a request of a new connection, or refuses it (NULL). clientaddr is
+// the peer address from accept, or NULL if it was not reported and has to be looked up
+//
+static Node* admit(Scheduler* s, int connfd, struct sockaddr_in* clientaddr)
 {
+    struct sockaddr_in peer;
+    socklen_t peerlen = sizeof(peer);
+    uint32_t client_addr = 0;
+
+    //only the rate limiter and fair queuing care who the client is
+    if (!clientaddr && (rate_limiter || s->waiting_requests->flows) &&
+        !getpeername(connfd, (SA*)&peer, &peerlen))
+    {
+        clientaddr = &peer;
+    }
+    if (clientaddr)
+    {
+        client_addr = clientaddr->sin_addr.s_addr;
+    }
+    if (stats_segment)
+    {
+        statsAdd(&stats_segment->accepted, 1);
+    }
+    if (!rateLimitAllow(rate_limiter, client_addr))
+    {
+        ssize_t sent = 0;
+        if (stats_segment)
+        {
+            statsAdd(&stats_segment->rate_limited, 1);
+        }
+        //a TLS client cannot read a plain answer, it is only disconnected
+        if (!tlsEnabled())
+        {
+            sent = send(connfd, too_many_requests, sizeof(too_many_requests) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        accessLogRefused(access_log, NULL, 429, sent > 0 ? sent : 0);
+        Close(connfd);
+        return NULL;
+    }
+
     Node* r = makeNode(connfd);
     if (r)
+    {
+        r->data->client_addr = client_addr;
+    }
+    return r;
+}
+
+//
+// Queues a new connection. clientaddr is the peer address from accept, or NULL
+// if it was not reported and has to be looked up
+//
+void request(Scheduler* s, int connfd, struct sockaddr_in* clientaddr) 
+{
+    Node* r = admit(s, connfd, clientaddr);
+    if (r)
     {
         enqueue(s->waiting_requests, r);
     }
 }
 
+//
+// Queues n new connections at once. clientaddrs holds their peer addresses,
+// or is NULL if accept did not report them
+//
+void requestBatch(Scheduler* s, int* connfds, struct sockaddr_in* clientaddrs, int n)
+{
+    Node* batch[SCHEDULE_ACCEPT_BATCH];
+    int num = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        Node* r = admit(s, connfds[i], clientaddrs ? &clientaddrs[i] : NULL);
+        if (r)
+        {
+            batch[num++] = r;
+        }
+        if (num == SCHEDULE_ACCEPT_BATCH || (num > 0 && i == n - 1))
+        {
+            enqueueBatch(s->waiting_requests, batch, num);
+            num = 0;
+        }
+    }
+}
+
+//
+// Answers 503 without waiting on the client. The request is read first:
+// closing a socket with unread data resets the connection, and the reset
+// could discard the answer. A TLS client is only disconnected.
+// Returns the bytes of the answer sent
+//
+static ssize_t scheduleReject(int connfd)
+{
+    char buf[REQUEST_MAX_HEADER_BYTES / 4];
+    ssize_t sent;
+
+    if (tlsEnabled())
+    {
+        return 0;
+    }
+    for (int i = 0; i < 4 && recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) == sizeof(buf); i++)
+        ;
+    sent = send(connfd, service_unavailable, sizeof(service_unavailable) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return sent > 0 ? sent : 0;
+}
+
+//
+// Closes the connection of a handled request, or of one answered with 503 if
+// expired is set, and gives its slot back to the queue
+//
+static void scheduleFinish(Scheduler* s, Node* temp, bool expired)
+{
+    Queue* q = s->waiting_requests;
+
+    //request had been handled, close connection
+    Close(temp->data->connfd);
+
+    //critical section - freeing a slot, under the lock enqueue waits for one with
+    pthread_mutex_lock(&q->global_lock);
+    __atomic_sub_fetch(&q->active_requests_num, 1, __ATOMIC_RELAXED);
+    if (stats_segment)
+    {
+        statsAdd(&stats_segment->completed, 1);
+        statsAdd(&stats_segment->expired, expired);
+    }
+    pthread_cond_signal(&q->insertion_allowed);
+    if (q->size == 0 && !__atomic_load_n(&q->stashed_num, __ATOMIC_RELAXED))
+    {
+        pthread_cond_signal(&q->is_empty);
+    }
+    pthread_mutex_unlock(&q->global_lock);
+
+    //done - free allocated resources
+    free(temp->data);
+    free(temp);
+}
+
+//
+// Stamps the dispatch time of a request taken off the queue. A request that
+// waited longer than max_sojourn_ms is answered with 503 instead - its client
+// has likely given up on it, and logged by worker index. Returns false then,
+// the request is only to be closed with scheduleFinish
+//
+static bool scheduleStart(Scheduler* s, int index, Node* temp)
+{
+    Request* r = temp->data;
+
+    //set request properties
+    gettimeofday(&r->stat_req_dispatch, NULL);
+    timersub(&r->stat_req_dispatch, &r->stat_req_arrival, &r->stat_req_dispatch);
+    if (s->max_sojourn_ms > 0 &&
+        r->stat_req_dispatch.tv_sec * 1000 + r->stat_req_dispatch.tv_usec / 1000 > s->max_sojourn_ms)
+    {
+        r->bytes_sent = scheduleReject(r->connfd);
+        r->status = 503;
+        accessLogAppend(access_log, index, r);
+        return false;
+    }
+    return true;
+}
+
 void schedule(Scheduler* s, int index) 
 {
     if (s)
     {
-        Node* temp = dequeue(s->waiting_requests, true);
+        Node* temp = scheduleNext(s, index, true);
         if (temp)
         {
-            //set request properties
-            gettimeofday(&temp->data->stat_req_dispatch, NULL);
-            timersub(&temp->data->stat_req_dispatch, &temp->data->stat_req_arrival, &temp->data->stat_req_dispatch);
-
             requests[index] = temp->data;
 
-            //critical section - changing queue size
-            pthread_mutex_lock(&s->global_lock);
-            s->waiting_requests->active_requests_num++;
-            pthread_mutex_unlock(&s->global_lock);
-
             //handle request
             requestHandle(temp->data->connfd, index);
 
             //restore requests arr
             requests[index] = NULL;
-            //request had been handled, close connection
-            Close(temp->data->connfd);
-
-            //critical section - changing queue size
-            pthread_mutex_lock(&s->global_lock);
-            s->waiting_requests->active_requests_num--;
-            pthread_mutex_unlock(&s->global_lock);
-            pthread_cond_signal(&s->waiting_requests->insertion_allowed);
-            if (s->waiting_requests->size == 0)
-            {
-                pthread_cond_signal(&s->waiting_requests->is_empty);
-            }
-            
-            //done - free allocated resources
-            free(temp->data);
-            free(temp);
+            scheduleDone(s, temp);
+        }
+    }
+}
+
+//
+// Takes the next request off the queue for worker index and counts it as active.
+// Requests that waited longer than max_sojourn_ms are answered on the way.
+// If block is set, waits while the queue is empty, otherwise returns NULL
+//
+Node* scheduleNext(Scheduler* s, int index, bool block)
+{
+    Node* temp;
+    while ((temp = dequeueNext(s->waiting_requests, index, block)))
+    {
+        if (scheduleStart(s, index, temp))
+        {
+            return temp;
         }
+        scheduleFinish(s, temp, true);
     }
+    return NULL;
+}
+
+//
+// Closes the connection of a handled request and gives its slot back to the queue
+//
+void scheduleDone(Scheduler* s, Node* temp)
+{
+    scheduleFinish(s, temp, false);
 }
 
 void freeScheduler(Scheduler* s)
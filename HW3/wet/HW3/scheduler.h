@@ -3,6 +3,17 @@
 
 #include "queue.h"
 
+/* longest a request may wait in the queue (milliseconds) before it is answered
+   with 503 instead of being served, 0 to serve every request. "make MAX_SOJOURN_MS=n" */
+#ifndef SCHED_MAX_SOJOURN_MS
+#define SCHED_MAX_SOJOURN_MS 0
+#endif
+
+/* most connections an accept loop queues at once */
+#define SCHEDULE_ACCEPT_BATCH 64
+/* longest pause of the accept loop before accepting again after accept failed, on EMFILE and the like (milliseconds) */
+#define SCHEDULE_ACCEPT_BACKOFF_MS 100
+
 /* Scheduler struct definition */
 typedef struct Scheduler 
 {
@@ -14,6 +25,8 @@ typedef struct Scheduler
     char* schedalg;
     int active_requests_num;
     int max_size;
+    //queue sojourn limit in milliseconds, 0 for none
+    long max_sojourn_ms;
     pthread_mutex_t global_lock;
     pthread_cond_t insertion_allowed;
     pthread_cond_t deletion_allowed;
@@ -24,8 +37,11 @@ typedef struct Scheduler
 Scheduler* makeScheduler(int pool_size, int http_connections_num, char* schedalg, int max_size,
     pthread_mutex_t global_lock, pthread_cond_t insertion_allowed,
     pthread_cond_t deletion_allowed, pthread_cond_t is_empty);
-void request(Scheduler* s, int connfd);
+void request(Scheduler* s, int connfd, struct sockaddr_in* clientaddr);
+void requestBatch(Scheduler* s, int* connfds, struct sockaddr_in* clientaddrs, int n);
 void schedule(Scheduler* s, int index);
+Node* scheduleNext(Scheduler* s, int index, bool block);
+void scheduleDone(Scheduler* s, Node* temp);
 void freeScheduler(Scheduler* s);
 
 #endif //SCHEDULER_H
\ No newline at end of file
@@ -1,4 +1,7 @@
 #include "segel.h"
+#include "transport.h"
+
+__thread rio_wait_fn rio_wait_hook = NULL;
 
 /**************************
  * Error-handling functions
@@ -308,6 +311,11 @@ ssize_t rio_writen(int fd, void* usrbuf, size_t n)
         if ((nwritten = write(fd, bufp, nleft)) <= 0) {
             if (errno == EINTR)  /* interrupted by sig handler return */
                 nwritten = 0;    /* and call write() again */
+            else if ((errno == EAGAIN || errno == EWOULDBLOCK) && rio_wait_hook) {
+                if (rio_wait_hook(fd, POLLOUT, NULL) < 0)
+                    return -1;   /* write timed out */
+                nwritten = 0;    /* socket drained, write again */
+            }
             else
                 return -1;       /* errorno set by write() */
         }
@@ -319,6 +327,62 @@ ssize_t rio_writen(int fd, void* usrbuf, size_t n)
 /* $end rio_writen */
 
 
+/*
+ * rio_wait - Blocks until the descriptor of rp is readable or the
+ *    deadline of rp passes. Returns 0 when readable (or when no deadline
+ *    is set, or the transport of rp waits itself) and -1 with errno set
+ *    to ETIMEDOUT once the deadline passes.
+ */
+static int rio_wait(rio_t* rp)
+{
+    struct timeval now, left;
+    struct pollfd pfd;
+    int rc;
+
+    if (!timerisset(&rp->rio_deadline) || (rp->rio_transport && rp->rio_transport->ops->recv))
+        return 0;
+    pfd.fd = rp->rio_fd;
+    pfd.events = POLLIN;
+    do {
+        gettimeofday(&now, NULL);
+        if (!timercmp(&now, &rp->rio_deadline, <)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        timersub(&rp->rio_deadline, &now, &left);
+        rc = poll(&pfd, 1, left.tv_sec * 1000 + left.tv_usec / 1000 + 1);
+    } while (rc < 0 && errno == EINTR);
+    if (rc == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * rio_recv - Reads from the descriptor of rp, through its transport if
+ *    it has one.
+ */
+static ssize_t rio_recv(rio_t* rp, char* buf, size_t n)
+{
+    if (rp->rio_transport && rp->rio_transport->ops->recv)
+        return rp->rio_transport->ops->recv(rp->rio_transport, buf, n, &rp->rio_deadline);
+    if (rp->rio_transport)
+        return rp->rio_transport->ops->read(rp->rio_transport, buf, n);
+    return read(rp->rio_fd, buf, n);
+}
+
+/*
+ * rio_pending - Returns the bytes the transport of rp has already taken
+ *    off the descriptor, a poll on it would not see them.
+ */
+static size_t rio_pending(rio_t* rp)
+{
+    if (rp->rio_transport)
+        return rp->rio_transport->ops->pending(rp->rio_transport);
+    return 0;
+}
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -333,10 +397,15 @@ static ssize_t rio_read(rio_t* rp, char* usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
-            sizeof(rp->rio_buf));
+        if (!rio_wait_hook && !rio_pending(rp) && rio_wait(rp) < 0)   /* deadline passed */
+            return -1;
+        rp->rio_cnt = rio_recv(rp, rp->rio_buf, sizeof(rp->rio_buf));
         if (rp->rio_cnt < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && rio_wait_hook) {
+                if (rio_wait_hook(rp->rio_fd, POLLIN, &rp->rio_deadline) < 0)
+                    return -1;  /* deadline passed */
+            }
+            else if (errno != EINTR) /* interrupted by sig handler return */
                 return -1;
         }
         else if (rp->rio_cnt == 0)  /* EOF */
@@ -365,9 +434,21 @@ void rio_readinitb(rio_t* rp, int fd)
     rp->rio_fd = fd;
     rp->rio_cnt = 0;
     rp->rio_bufptr = rp->rio_buf;
+    timerclear(&rp->rio_deadline);
+    rp->rio_transport = NULL;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_readinit_transport - Like rio_readinitb, for a connection read
+ *    through a transport (see transport.h)
+ */
+void rio_readinit_transport(rio_t* rp, struct Transport* t)
+{
+    rio_readinitb(rp, t->fd);
+    rp->rio_transport = t;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -423,6 +504,75 @@ ssize_t rio_readlineb(rio_t* rp, void* usrbuf, size_t maxlen)
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readhead - read a message head, up to and including the empty line
+ *    that ends it, without copying it out of the internal buffer. On
+ *    success *headp points at the head inside the buffer and its length is
+ *    returned; it stays valid until the next read from rp. Returns 0 on EOF
+ *    before the head is complete, and -1 on error, with errno set to
+ *    EMSGSIZE if the head does not fit in maxlen (or the buffer).
+ */
+ssize_t rio_readhead(rio_t* rp, char** headp, size_t maxlen)
+{
+    size_t scanned = 0, len;
+    ssize_t n;
+    char* eol;
+
+    if (maxlen > sizeof(rp->rio_buf))
+        maxlen = sizeof(rp->rio_buf);
+    /* the head has to be contiguous - move unread bytes to the front */
+    if (rp->rio_cnt <= 0)
+        rp->rio_cnt = 0;
+    else if (rp->rio_bufptr != rp->rio_buf)
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+
+    while (1) {
+        /* an empty line is a LF followed by LF or CRLF */
+        while ((eol = memchr(rp->rio_buf + scanned, '\n', rp->rio_cnt - scanned))) {
+            len = eol - rp->rio_buf + 1;
+            if (len < rp->rio_cnt && rp->rio_buf[len] == '\n')
+                len += 1;
+            else if (len + 1 < rp->rio_cnt && rp->rio_buf[len] == '\r' && rp->rio_buf[len + 1] == '\n')
+                len += 2;
+            else if (len + 1 >= rp->rio_cnt) { /* may end in the next read */
+                scanned = len - 1;
+                break;
+            }
+            else {
+                scanned = len;
+                continue;
+            }
+            if (len > maxlen)
+                break;
+            *headp = rp->rio_buf;
+            rp->rio_bufptr += len;
+            rp->rio_cnt -= len;
+            return len;
+        }
+        if (rp->rio_cnt >= maxlen) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        if (!rio_wait_hook && !rio_pending(rp) && rio_wait(rp) < 0)   /* deadline passed */
+            return -1;
+        n = rio_recv(rp, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt);
+        if (n < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && rio_wait_hook) {
+                if (rio_wait_hook(rp->rio_fd, POLLIN, &rp->rio_deadline) < 0)
+                    return -1;  /* deadline passed */
+            }
+            else if (errno != EINTR) /* interrupted by sig handler return */
+                return -1;
+        }
+        else if (n == 0)  /* EOF */
+            return 0;
+        else
+            rp->rio_cnt += n;
+    }
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -23,6 +23,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
 
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -38,15 +39,25 @@ typedef struct sockaddr SA;
 
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
+/* large enough for a whole request head, see rio_readhead */
+#define RIO_BUFSIZE 16384
 typedef struct {
     int rio_fd;                /* descriptor for this internal buf */
     int rio_cnt;               /* unread bytes in internal buf */
     char* rio_bufptr;          /* next unread byte in internal buf */
+    struct timeval rio_deadline; /* absolute read deadline, unset for none */
+    struct Transport* rio_transport; /* reads through it, NULL for plain read() */
     char rio_buf[RIO_BUFSIZE]; /* internal buffer */
 } rio_t;
 /* $end rio_t */
 
+/* Suspends the caller until fd is ready for events (POLLIN/POLLOUT) or the
+   deadline passes, -1 with errno set to ETIMEDOUT then. A NULL or unset deadline
+   selects the waiter's default I/O timeout. Set per thread by an event loop
+   that multiplexes non-blocking descriptors (see coroutine.c) */
+typedef int (*rio_wait_fn)(int fd, short events, struct timeval* deadline);
+extern __thread rio_wait_fn rio_wait_hook;
+
 /* External variables */
 extern int h_errno;    /* defined by BIND for DNS errors */
 extern char** environ; /* defined by libc */
@@ -104,8 +115,10 @@ struct hostent* Gethostbyaddr(const char* addr, int len, int type);
 ssize_t rio_readn(int fd, void* usrbuf, size_t n);
 ssize_t rio_writen(int fd, void* usrbuf, size_t n);
 void rio_readinitb(rio_t* rp, int fd);
+void rio_readinit_transport(rio_t* rp, struct Transport* t);
 ssize_t rio_readnb(rio_t* rp, void* usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t* rp, void* usrbuf, size_t maxlen);
+ssize_t rio_readhead(rio_t* rp, char** headp, size_t maxlen);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void* usrbuf, size_t n);
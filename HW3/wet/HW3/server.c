@@ -1,7 +1,22 @@
+#define _GNU_SOURCE
+
 #include "segel.h"
 #include "request.h"
 #include "queue.h"
 #include "scheduler.h"
+#include "compress.h"
+#include "mime.h"
+#include "accesslog.h"
+#include "ratelimit.h"
+#include "hugemem.h"
+#include "shmstats.h"
+#include "transport.h"
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
+#ifdef USE_COROUTINES
+#include "coroutine.h"
+#endif
 // 
 // server.c: A very, very simple web server
 //
@@ -50,6 +65,14 @@ void getargs(int* port, int argc, char* argv[])
 
 void* requests_handler(void* id) 
 {
+#ifdef USE_COROUTINES
+    //serve many connections per worker; returns only if the event loop cannot start
+    CoroutinePool* pool = makeCoroutinePool(*(int*)id);
+    if (pool)
+    {
+        coroutineLoop(pool, scheduler);
+    }
+#endif
     while (true) 
     {
         //keep in scheduling upcoming requests
@@ -60,10 +83,27 @@ void* requests_handler(void* id)
 int main(int argc, char* argv[]) {
     int listenfd, connfd, port, clientlen;
     struct sockaddr_in clientaddr;
+    int connfds[SCHEDULE_ACCEPT_BATCH];
+    struct sockaddr_in clientaddrs[SCHEDULE_ACCEPT_BATCH];
 
     //init user arguments
     getargs(&port, argc, argv);
 
+    //optional content type overrides
+    if (mimeLoad(MIME_TYPES_FILE) > 0)
+    {
+        printf("Loaded content types from %s\n", MIME_TYPES_FILE);
+    }
+
+    //HTTPS when a certificate and its key are in place
+    if (!tlsLoad(TLS_CERT_FILE, TLS_KEY_FILE))
+    {
+        printf("Serving TLS with %s\n", TLS_CERT_FILE);
+    }
+
+    //a client that disconnects mid-response must fail the write, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     //
     // HW3: Create some threads...
     //
@@ -107,6 +147,44 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    compress_cache = makeCompressCache(COMPRESS_CACHE_BYTES);
+    if (!compress_cache)
+    {
+        printf("Memmory allocation error! \n");
+        free(requests);
+        free(threads);
+        free(threads_handler);
+        freeScheduler(scheduler);
+        return -1;
+    }
+    //the cache leaves room for a descriptor per connection queued or in service
+#ifdef USE_COROUTINES
+    fd_cache = makeFdCache(fdCacheCapacity(http_connections_nums + pool_size * CO_PER_WORKER));
+#else
+    fd_cache = makeFdCache(fdCacheCapacity(http_connections_nums + pool_size));
+#endif
+    if (!fd_cache)
+    {
+        printf("Memmory allocation error! \n");
+        free(requests);
+        free(threads);
+        free(threads_handler);
+        freeScheduler(scheduler);
+        freeCompressCache(compress_cache);
+        return -1;
+    }
+
+#ifdef USE_RATE_LIMIT
+    //without a limiter every client is let in
+    rate_limiter = makeRateLimiter();
+#endif
+
+    //counters shared with serverstat, the server keeps them privately if it cannot
+    stats_segment = makeStatsSegment(port, pool_size);
+
+    //the server runs without an access log if it cannot have one
+    access_log = makeAccessLog(pool_size);
+
     //init indexes
     int* workers_index = malloc(pool_size * sizeof(int));
     if (!workers_index)
@@ -116,6 +194,8 @@ int main(int argc, char* argv[]) {
         free(threads);
         free(threads_handler);
         freeScheduler(scheduler);
+        freeCompressCache(compress_cache);
+        freeFdCache(fd_cache);
         return -1;
     }
     for (int i = 0; i < pool_size; i++)
@@ -126,23 +206,88 @@ int main(int argc, char* argv[]) {
     //init worker threads
     for (int i = 0; i < pool_size; i++) 
     {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+#ifdef USE_HUGEPAGES
+        //request buffers live on the worker stack - back it with huge pages,
+        //reused by every request the worker handles
+        void* stack = hugeAlloc(HUGE_STACK_SIZE);
+        if (stack)
+        {
+            pthread_attr_setstack(&attr, stack, HUGE_STACK_SIZE);
+        }
+#endif
         //allocate new threads, if one fails - exit
-        if (pthread_create(&threads[i], NULL, (void*)requests_handler, (void*)&workers_index[i])) 
+        if (pthread_create(&threads[i], &attr, (void*)requests_handler, (void*)&workers_index[i])) 
         {
             exit(1);
         }
-        threads_handler[i] = makeThread(i);
+        pthread_attr_destroy(&attr);
+        if (stats_segment)
+        {
+            threads_handler[i] = &stats_segment->threads[i].t;
+            initThread(threads_handler[i], i);
+        }
+        else
+        {
+            threads_handler[i] = makeThread(i);
+        }
     }
     listenfd = Open_listenfd(port);
+
+#ifdef USE_IO_URING
+    //batch accepts through io_uring when the kernel allows it
+    Uring* ring = makeUring(URING_ENTRIES);
+    if (ring)
+    {
+        uringAcceptLoop(ring, listenfd, scheduler);
+        //ring stopped working - fall back to blocking accepts
+        freeUring(ring);
+    }
+#endif
+    //wait for connections, then take all that are pending without blocking
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    int backoff_ms = 0;
     while (1) {
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA*)&clientaddr, (socklen_t*)&clientlen);
+        struct pollfd pfd = { listenfd, POLLIN, 0 };
+        int num = 0;
+        bool failed = false;
+
+        poll(&pfd, 1, -1);
+        while (num < SCHEDULE_ACCEPT_BATCH) {
+            clientlen = sizeof(clientaddr);
+            connfd = accept4(listenfd, (SA*)&clientaddrs[num], (socklen_t*)&clientlen, SOCK_CLOEXEC);
+            if (connfd < 0) {
+                //EAGAIN - drained; a connection reset before it was accepted is skipped
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    break;
+                }
+                if (errno == ECONNABORTED) {
+                    continue;
+                }
+                //out of descriptors or memory - queue what was accepted and back off
+                failed = true;
+                break;
+            }
+            connfds[num++] = connfd;
+        }
 
         //
         // HW3: In general, don't handle the request in the main thread.
         // Save the relevant info in a buffer and have one of the worker threads
         // do the work.
         //
-        request(scheduler, connfd);
+        requestBatch(scheduler, connfds, clientaddrs, num);
+
+        //the pending connections would fail again at once, so wait longer each
+        //time they do, up to the limit, as the io_uring accept loop does
+        if (failed) {
+            backoff_ms = backoff_ms ? backoff_ms * 2 : 1;
+            backoff_ms = backoff_ms < SCHEDULE_ACCEPT_BACKOFF_MS ? backoff_ms : SCHEDULE_ACCEPT_BACKOFF_MS;
+            usleep(backoff_ms * 1000);
+        }
+        else {
+            backoff_ms = 0;
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,142 @@
+/*
+ * serverstat.c: Reports the activity of a running server, in the style of vmstat.
+ *
+ * To run:
+ *      ./serverstat <port> [interval [count]]
+ *
+ * Attaches read only to the stats segment of the server on port, and prints a
+ * line every interval seconds (default 1), count times (default forever).
+ * The first line shows averages since the server started.
+ */
+
+#include "segel.h"
+#include "shmstats.h"
+
+/* Snapshot struct definition - totals read from the segment */
+typedef struct Snapshot
+{
+    struct timeval taken;
+    uint64_t count, statics, dynamics, timeouts, oversized;
+    uint64_t accepted, rate_limited, dispatched, completed, stashed, expired, queue_size, queue_capacity;
+    uint64_t log_dropped;
+} Snapshot;
+
+static uint64_t load(uint64_t* field)
+{
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+static void takeSnapshot(StatsSegment* s, Snapshot* snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    gettimeofday(&snap->taken, NULL);
+    for (int i = 0; i < s->threads_num; i++)
+    {
+        Thread* t = &s->threads[i].t;
+        snap->count += __atomic_load_n(&t->stat_thread_count, __ATOMIC_RELAXED);
+        snap->statics += __atomic_load_n(&t->stat_thread_static, __ATOMIC_RELAXED);
+        snap->dynamics += __atomic_load_n(&t->stat_thread_dynamic, __ATOMIC_RELAXED);
+        snap->timeouts += __atomic_load_n(&t->stat_thread_timeouts, __ATOMIC_RELAXED);
+        snap->oversized += __atomic_load_n(&t->stat_thread_oversized, __ATOMIC_RELAXED);
+    }
+    snap->accepted = load(&s->accepted);
+    snap->rate_limited = load(&s->rate_limited);
+    snap->dispatched = load(&s->dispatched);
+    snap->completed = load(&s->completed);
+    snap->stashed = load(&s->stashed);
+    snap->expired = load(&s->expired);
+    snap->queue_size = load(&s->queue_size);
+    snap->queue_capacity = load(&s->queue_capacity);
+    snap->log_dropped = load(&s->log_dropped);
+}
+
+//connections that were neither refused, handed to a worker nor are still waiting
+static uint64_t dropped(Snapshot* snap)
+{
+    uint64_t kept = snap->rate_limited + snap->dispatched + snap->stashed + snap->queue_size;
+    return snap->accepted > kept ? snap->accepted - kept : 0;
+}
+
+static void printRow(Snapshot* now, Snapshot* before)
+{
+    struct timeval diff;
+    double secs;
+
+    timersub(&now->taken, &before->taken, &diff);
+    secs = diff.tv_sec + diff.tv_usec / 1e6;
+    if (secs <= 0)
+    {
+        secs = 1;
+    }
+#define RATE(field) (unsigned long)((now->field - before->field) / secs + 0.5)
+    printf("%8lu %7lu %7lu %6lu %6lu %6lu %8lu %7lu %7lu %7lu %8lu %9lu %8lu\n",
+        RATE(count), RATE(statics), RATE(dynamics),
+        (unsigned long)(now->queue_size + now->stashed), (unsigned long)now->queue_capacity,
+        (unsigned long)(now->dispatched - now->completed),
+        RATE(accepted), (unsigned long)((dropped(now) - dropped(before)) / secs + 0.5), RATE(rate_limited),
+        RATE(expired), RATE(timeouts), RATE(oversized), RATE(log_dropped));
+#undef RATE
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    char name[64];
+    int fd, interval = 1, count = -1;
+    struct stat sbuf;
+    StatsSegment* s;
+    Snapshot start, before, now;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <port> [interval [count]]\n", argv[0]);
+        exit(1);
+    }
+    if (argc > 2 && (interval = atoi(argv[2])) <= 0)
+    {
+        interval = 1;
+    }
+    if (argc > 3)
+    {
+        count = atoi(argv[3]);
+    }
+
+    statsSegmentName(name, atoi(argv[1]));
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0 || fstat(fd, &sbuf) < 0)
+    {
+        fprintf(stderr, "%s: no server statistics for port %s\n", argv[0], argv[1]);
+        exit(1);
+    }
+    s = mmap(0, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED || sbuf.st_size < sizeof(StatsSegment) || strncmp(s->magic, STATS_MAGIC, sizeof(s->magic)) ||
+        s->version != STATS_VERSION || s->header_size != sizeof(StatsSegment) || s->thread_size != sizeof(StatsThread) ||
+        sbuf.st_size < sizeof(StatsSegment) + s->threads_num * sizeof(StatsThread))
+    {
+        fprintf(stderr, "%s: statistics of port %s are from another server version\n", argv[0], argv[1]);
+        exit(1);
+    }
+    if (kill(s->pid, 0) < 0 && errno == ESRCH)
+    {
+        fprintf(stderr, "%s: the server on port %s (pid %lu) is gone, showing its last statistics\n",
+            argv[0], argv[1], (unsigned long)s->pid);
+    }
+
+    //the first row covers the whole life of the server
+    memset(&start, 0, sizeof(start));
+    start.taken.tv_sec = s->start_usec / 1000000;
+    start.taken.tv_usec = s->start_usec % 1000000;
+    takeSnapshot(s, &now);
+
+    printf("------requests/s------ -------queue------- ----------connections/s---------- ---------errors/s---------\n");
+    printf("   total  static dynamic waiting  bound active accepted dropped limited expired timeouts oversized unlogged\n");
+    printRow(&now, &start);
+    for (int i = 1; count < 0 || i < count; i++)
+    {
+        before = now;
+        sleep(interval);
+        takeSnapshot(s, &now);
+        printRow(&now, &before);
+    }
+    return 0;
+}
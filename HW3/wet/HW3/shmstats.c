@@ -0,0 +1,79 @@
+//
+// shmstats.c: Runtime statistics in a POSIX shared memory segment.
+// The server keeps its counters in the segment itself, so publishing them
+// costs nothing beyond the update, and tools like serverstat read them
+// without sending the server a single request.
+//
+
+#include "shmstats.h"
+
+StatsSegment* stats_segment;
+
+/* StatsSegment mathods implementation */
+
+void statsSegmentName(char* name, int port)
+{
+    sprintf(name, "%s.%d", STATS_SHM_NAME, port);
+}
+
+//
+// Creates the segment of the server on port, replacing a stale one.
+// Returns NULL if shared memory is not available
+//
+StatsSegment* makeStatsSegment(int port, int threads_num)
+{
+    char name[64];
+    size_t size = sizeof(StatsSegment) + threads_num * sizeof(StatsThread);
+    StatsSegment* s;
+    struct timeval now;
+    int fd;
+
+    statsSegmentName(name, port);
+    shm_unlink(name);
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0)
+    {
+        return NULL;
+    }
+    if (ftruncate(fd, size) < 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    s = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    //a new segment reads as zeros - fill in the header, the magic goes last
+    gettimeofday(&now, NULL);
+    s->version = STATS_VERSION;
+    s->header_size = sizeof(StatsSegment);
+    s->thread_size = sizeof(StatsThread);
+    s->threads_num = threads_num;
+    s->pid = getpid();
+    s->start_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    strcpy(s->magic, STATS_MAGIC);
+    return s;
+}
+
+//the writer of counter is the only one, so a plain relaxed store does
+void statsAdd(uint64_t* counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+//adds n to a counter other threads add to at the same time
+void statsAddShared(uint64_t* counter, int64_t n)
+{
+    __atomic_add_fetch(counter, (uint64_t)n, __ATOMIC_RELAXED);
+}
+
+void statsSet(uint64_t* field, uint64_t value)
+{
+    __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,64 @@
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include <stdint.h>
+#include "segel.h"
+#include "thread.h"
+
+/* the segment of the server on port p is STATS_SHM_NAME.p (in /dev/shm) */
+#define STATS_SHM_NAME "/os-hw3-stats"
+#define STATS_MAGIC "HW3STAT"
+/* bumped whenever the layout below changes */
+#define STATS_VERSION 4
+
+/* StatsThread struct definition - a worker's counters on their own cache line */
+typedef struct StatsThread
+{
+    Thread t;
+} __attribute__((aligned(64))) StatsThread;
+
+/* StatsSegment struct definition - what serverstat sees. Every field has a
+   single writer at a time and is stored with relaxed atomics, or is added to
+   by many with statsAddShared. Readers load them the same way and may see the
+   counters a moment apart */
+typedef struct StatsSegment
+{
+    char magic[8];
+    uint32_t version;
+    //sizeof(StatsSegment) and sizeof(StatsThread) of the writer
+    uint32_t header_size;
+    uint32_t thread_size;
+    uint32_t threads_num;
+    uint64_t pid;
+    //server start, microseconds since the epoch
+    uint64_t start_usec;
+    //connections accepted, and refused by the rate limiter (master thread)
+    uint64_t accepted;
+    uint64_t rate_limited;
+    //requests started by a worker (shared), and finished (under the queue lock)
+    uint64_t dispatched;
+    uint64_t completed;
+    //requests off the queue in the stash of a worker, not started yet (shared)
+    uint64_t stashed;
+    //requests answered with 503 for waiting in the queue too long, counted as
+    //dispatched and completed as well (under the queue lock)
+    uint64_t expired;
+    //waiting requests and the queue bound (under the queue lock)
+    uint64_t queue_size;
+    uint64_t queue_capacity;
+    //access log records lost because a ring was full (access log writer)
+    uint64_t log_dropped;
+    StatsThread threads[];
+} StatsSegment;
+
+/* StatsSegment mathods */
+StatsSegment* makeStatsSegment(int port, int threads_num);
+void statsSegmentName(char* name, int port);
+void statsAdd(uint64_t* counter, uint64_t n);
+void statsAddShared(uint64_t* counter, int64_t n);
+void statsSet(uint64_t* field, uint64_t value);
+
+/* global vars */
+extern StatsSegment* stats_segment;
+
+#endif //SHMSTATS_H
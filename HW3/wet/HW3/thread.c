@@ -10,11 +10,16 @@ Thread* makeThread(int stat_thread_id)
         printf("Memory allocation error!\n");
         return NULL;
     }
+    initThread(t, stat_thread_id);
+    return t;
+}
 
+void initThread(Thread* t, int stat_thread_id)
+{
     t->stat_thread_id = stat_thread_id;
     t->stat_thread_count = 0;
     t->stat_thread_static = 0;
     t->stat_thread_dynamic = 0;
-
-    return t;
+    t->stat_thread_timeouts = 0;
+    t->stat_thread_oversized = 0;
 }
\ No newline at end of file
@@ -7,9 +7,23 @@ typedef struct Thread
     int stat_thread_static;
     int stat_thread_dynamic;
     int stat_thread_count;
+    //connections evicted for missing a read or write deadline
+    int stat_thread_timeouts;
+    //requests rejected for exceeding the header size cap
+    int stat_thread_oversized;
 } Thread;
 
 Thread* makeThread(int stat_thread_id);
+void initThread(Thread* t, int stat_thread_id);
+
+//counters are read by serverstat while their worker updates them (see shmstats.h).
+//Only the worker writes them, so a relaxed store of the new value is enough
+static inline int statInc(int* counter)
+{
+    int value = *counter + 1;
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+    return value;
+}
 
 //global vars
 Thread** threads_handler;
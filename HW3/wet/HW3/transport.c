@@ -0,0 +1,449 @@
+//
+// transport.c: The connection layer under rio_t and the response writers.
+// A plain connection maps every op to its system call. With TLS (make TLS=1
+// and a certificate in place) the ops go through an OpenSSL session instead:
+// sessions are resumed from a server side cache or a ticket, and when the
+// kernel takes over the record layer (kTLS) sendfile still goes straight from
+// the page cache, otherwise files are encrypted TLS_SENDFILE_CHUNK at a time.
+// A plain connection of a worker thread goes through the io_uring of the worker
+// when the kernel has one to give (see uring.c).
+//
+
+#define _GNU_SOURCE
+
+#include "transport.h"
+#include <sys/sendfile.h>
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
+#ifdef USE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+/* Transport mathods implementation */
+
+static ssize_t plainRead(Transport* t, void* buf, size_t n)
+{
+    return read(t->fd, buf, n);
+}
+
+static ssize_t plainWrite(Transport* t, const void* buf, size_t n)
+{
+    return write(t->fd, buf, n);
+}
+
+static ssize_t plainWritev(Transport* t, const struct iovec* iov, int iovcnt)
+{
+    return writev(t->fd, iov, iovcnt);
+}
+
+static ssize_t plainSendfile(Transport* t, int srcfd, off_t* offset, size_t n)
+{
+    return sendfile(t->fd, srcfd, offset, n);
+}
+
+static size_t plainPending(Transport* t)
+{
+    return 0;
+}
+
+static void plainClose(Transport* t)
+{
+}
+
+static const TransportOps plain_ops = {
+    plainRead, plainWrite, plainWritev, plainSendfile, plainPending, plainClose, NULL, NULL
+};
+
+#ifdef USE_IO_URING
+
+//deadline of a write starting now
+static struct timeval* ringWriteDeadline(Transport* t, struct timeval* deadline)
+{
+    if (!timerisset(&t->write_timeout))
+    {
+        return NULL;
+    }
+    gettimeofday(deadline, NULL);
+    timeradd(deadline, &t->write_timeout, deadline);
+    return deadline;
+}
+
+static ssize_t ringRecv(Transport* t, void* buf, size_t n, struct timeval* deadline)
+{
+    return uringRecv(t->ring, t->fd, buf, n, deadline && timerisset(deadline) ? deadline : NULL);
+}
+
+static ssize_t ringRead(Transport* t, void* buf, size_t n)
+{
+    return ringRecv(t, buf, n, NULL);
+}
+
+static ssize_t ringWritev(Transport* t, const struct iovec* iov, int iovcnt)
+{
+    struct timeval deadline;
+    return uringSendmsg(t->ring, t->fd, iov, iovcnt, ringWriteDeadline(t, &deadline));
+}
+
+static ssize_t ringWrite(Transport* t, const void* buf, size_t n)
+{
+    struct iovec iov = { (void*)buf, n };
+    return ringWritev(t, &iov, 1);
+}
+
+static ssize_t ringSendfilev(Transport* t, const struct iovec* iov, int iovcnt, int srcfd, off_t* offset, size_t n)
+{
+    struct timeval deadline;
+    return uringSendfile(t->ring, t->fd, iov, iovcnt, srcfd, offset, n, ringWriteDeadline(t, &deadline));
+}
+
+static ssize_t ringSendfile(Transport* t, int srcfd, off_t* offset, size_t n)
+{
+    return ringSendfilev(t, NULL, 0, srcfd, offset, n);
+}
+
+static const TransportOps ring_ops = {
+    ringRead, ringWrite, ringWritev, ringSendfile, plainPending, plainClose, ringRecv, ringSendfilev
+};
+
+#endif
+
+#ifdef USE_TLS
+
+static SSL_CTX* tls_context;
+
+//
+// Blocks until fd is ready for events or the deadline passes.
+// Returns 0 when ready, -1 otherwise
+//
+static int transportWait(int fd, short events, struct timeval* deadline)
+{
+    struct timeval now, left;
+    struct pollfd pfd = { fd, events, 0 };
+    int rc;
+
+    if (rio_wait_hook)
+    {
+        return rio_wait_hook(fd, events, deadline);
+    }
+    do
+    {
+        gettimeofday(&now, NULL);
+        if (!timercmp(&now, deadline, <))
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        timersub(deadline, &now, &left);
+        rc = poll(&pfd, 1, left.tv_sec * 1000 + left.tv_usec / 1000 + 1);
+    } while (rc < 0 && errno == EINTR);
+    if (rc == 0)
+    {
+        errno = ETIMEDOUT;
+    }
+    return rc > 0 ? 0 : -1;
+}
+
+//maps the outcome of an SSL call to the result of the matching system call
+static ssize_t tlsResult(Transport* t, int rc)
+{
+    if (rc > 0)
+    {
+        return rc;
+    }
+    switch (SSL_get_error(t->ssl, rc))
+    {
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_SYSCALL:
+        if (!errno)
+        {
+            errno = EIO;
+        }
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+static ssize_t tlsRead(Transport* t, void* buf, size_t n)
+{
+    ERR_clear_error();
+    return tlsResult(t, SSL_read(t->ssl, buf, n));
+}
+
+static ssize_t tlsWrite(Transport* t, const void* buf, size_t n)
+{
+    ERR_clear_error();
+    return tlsResult(t, SSL_write(t->ssl, buf, n));
+}
+
+//a record per call - the first non empty buffer, which is a short writev
+static ssize_t tlsWritev(Transport* t, const struct iovec* iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len)
+        {
+            return tlsWrite(t, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    return 0;
+}
+
+static ssize_t tlsSendfile(Transport* t, int srcfd, off_t* offset, size_t n)
+{
+    char buf[TLS_SENDFILE_CHUNK];
+    ssize_t rc;
+
+    if (t->ktls)
+    {
+        ERR_clear_error();
+        if ((rc = SSL_sendfile(t->ssl, srcfd, *offset, n, 0)) > 0)
+        {
+            *offset += rc;
+        }
+        return tlsResult(t, rc);
+    }
+    // a retry after EAGAIN reads the same chunk again, which the session
+    // accepts from a different buffer (SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER)
+    if ((rc = pread(srcfd, buf, n < sizeof(buf) ? n : sizeof(buf), *offset)) <= 0)
+    {
+        return rc;
+    }
+    if ((rc = tlsWrite(t, buf, rc)) > 0)
+    {
+        *offset += rc;
+    }
+    return rc;
+}
+
+static size_t tlsPending(Transport* t)
+{
+    return SSL_pending(t->ssl);
+}
+
+static void tlsClose(Transport* t)
+{
+    //sends close_notify, without waiting for the client to answer it
+    ERR_clear_error();
+    SSL_shutdown(t->ssl);
+    SSL_free(t->ssl);
+    t->ssl = NULL;
+}
+
+static const TransportOps tls_ops = {
+    tlsRead, tlsWrite, tlsWritev, tlsSendfile, tlsPending, tlsClose, NULL, NULL
+};
+
+int tlsLoad(char* cert, char* key)
+{
+    static const unsigned char session_id_context[] = "os-hw3";
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+
+    if (!ctx)
+    {
+        return -1;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        SSL_CTX_free(ctx);
+        ERR_clear_error();
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // kTLS is used where both OpenSSL and the kernel support it, a client
+    // closing without close_notify is a plain end of stream
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // resumption - session ids from the shared cache (TLS 1.2) and
+    // tickets (TLS 1.2 and 1.3, on by default)
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    tls_context = ctx;
+    return 0;
+}
+
+bool tlsEnabled()
+{
+    return tls_context != NULL;
+}
+
+//
+// Runs the TLS handshake on fd, until it completes or the deadline passes.
+// Returns 0 on success, -1 otherwise
+//
+static int tlsOpen(Transport* t, int fd, struct timeval* deadline)
+{
+    int rc;
+
+    if (!(t->ssl = SSL_new(tls_context)) || !SSL_set_fd(t->ssl, fd))
+    {
+        SSL_free(t->ssl);
+        t->ssl = NULL;
+        return -1;
+    }
+    ERR_clear_error();
+    while ((rc = SSL_accept(t->ssl)) != 1)
+    {
+        rc = SSL_get_error(t->ssl, rc);
+        if ((rc != SSL_ERROR_WANT_READ && rc != SSL_ERROR_WANT_WRITE) ||
+            transportWait(fd, rc == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, deadline) < 0)
+        {
+            SSL_free(t->ssl);
+            t->ssl = NULL;
+            ERR_clear_error();
+            return -1;
+        }
+        ERR_clear_error();
+    }
+    t->ops = &tls_ops;
+    t->ktls = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+    return 0;
+}
+
+#else
+
+int tlsLoad(char* cert, char* key)
+{
+    return -1;
+}
+
+bool tlsEnabled()
+{
+    return false;
+}
+
+#endif
+
+//
+// Sets up the connection on fd, with a TLS handshake when TLS is enabled.
+// A blocking socket also gets a read timeout, so a client stalling in the
+// middle of a record cannot hold the worker past the deadline for long.
+// Writes are bounded by write_timeout: SO_SNDTIMEO of the socket, which also
+// holds for splices the ring runs in its workers, and a deadline for each write
+// on the io_uring of the worker, which waits for the socket without blocking.
+// Returns 0 on success, -1 otherwise
+//
+int transportOpen(Transport* t, int fd, struct timeval* deadline, struct timeval* write_timeout)
+{
+    t->ops = &plain_ops;
+    t->fd = fd;
+    t->ssl = NULL;
+    t->ktls = false;
+    t->ring = NULL;
+    t->write_timeout = *write_timeout;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, write_timeout, sizeof(*write_timeout));
+#ifdef USE_IO_URING
+    //the ring waits on its own, a coroutine waits on the event loop of the worker
+    if (!tlsEnabled() && !rio_wait_hook && (t->ring = uringThreadIo()))
+    {
+        t->ops = &ring_ops;
+        return 0;
+    }
+#endif
+#ifdef USE_TLS
+    if (tls_context)
+    {
+        struct timeval read_timeout = { TLS_READ_TIMEOUT, 0 };
+
+        if (!rio_wait_hook)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof(read_timeout));
+        }
+        return tlsOpen(t, fd, deadline);
+    }
+#endif
+    return 0;
+}
+
+//
+// Writes n bytes over t, like rio_writen. Returns n on success, -1 otherwise
+//
+ssize_t transportWriten(Transport* t, void* buf, size_t n)
+{
+    size_t nleft = n;
+    ssize_t nwritten;
+    char* bufp = buf;
+
+    while (nleft > 0)
+    {
+        if ((nwritten = t->ops->write(t, bufp, nleft)) <= 0)
+        {
+            if (nwritten < 0 && errno == EINTR)
+            {
+                nwritten = 0;
+            }
+            else if (nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && rio_wait_hook)
+            {
+                if (rio_wait_hook(t->fd, POLLOUT, NULL) < 0)
+                {
+                    return -1;
+                }
+                nwritten = 0;
+            }
+            else
+            {
+                return -1;
+            }
+        }
+        nleft -= nwritten;
+        bufp += nwritten;
+    }
+    return n;
+}
+
+//
+// Writes all iovcnt buffers over t, in as few calls as the transport allows.
+// iov is consumed on the way. Returns the bytes written on success, -1 otherwise
+//
+ssize_t transportWritevn(Transport* t, struct iovec* iov, int iovcnt)
+{
+    ssize_t total = 0, nwritten;
+
+    while (iovcnt > 0)
+    {
+        if ((nwritten = t->ops->writev(t, iov, iovcnt)) <= 0)
+        {
+            if (nwritten < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && rio_wait_hook &&
+                !rio_wait_hook(t->fd, POLLOUT, NULL))
+            {
+                continue;
+            }
+            return -1;
+        }
+        total += nwritten;
+        //skip what went out, the last buffer may have gone out in part
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len)
+        {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return total;
+}
+
+void transportClose(Transport* t)
+{
+    t->ops->close(t);
+}
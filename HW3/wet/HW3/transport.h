@@ -0,0 +1,65 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdbool.h>
+#include <sys/uio.h>
+#include "segel.h"
+
+/* certificate chain and private key loaded at startup - when both are in place
+   (and the server is built with TLS) every connection speaks HTTPS */
+#define TLS_CERT_FILE "./server.crt"
+#define TLS_KEY_FILE "./server.key"
+/* sessions kept for resumption, and for how long (seconds) */
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_SESSION_TIMEOUT 300
+/* longest a blocking read may stall in the middle of a record (seconds) */
+#define TLS_READ_TIMEOUT 10
+/* largest piece of a file encrypted at once when the kernel cannot do it */
+#define TLS_SENDFILE_CHUNK 16384
+
+typedef struct Transport Transport;
+
+/* TransportOps struct definition - how bytes move over one kind of connection.
+   Each op behaves like the system call of the same name, a call that would
+   block fails with EAGAIN, one that missed its deadline with ETIMEDOUT */
+typedef struct TransportOps
+{
+    ssize_t (*read)(Transport* t, void* buf, size_t n);
+    ssize_t (*write)(Transport* t, const void* buf, size_t n);
+    ssize_t (*writev)(Transport* t, const struct iovec* iov, int iovcnt);
+    ssize_t (*sendfile)(Transport* t, int srcfd, off_t* offset, size_t n);
+    //bytes already received and decoded, which polling the socket does not see
+    size_t (*pending)(Transport* t);
+    void (*close)(Transport* t);
+    //read that waits for data itself until deadline (unset for none), so the
+    //caller does not poll first. NULL if the transport has none
+    ssize_t (*recv)(Transport* t, void* buf, size_t n, struct timeval* deadline);
+    //sendfile that sends all of iov first, in the same submission.
+    //NULL if the transport has none
+    ssize_t (*sendfilev)(Transport* t, const struct iovec* iov, int iovcnt, int srcfd, off_t* offset, size_t n);
+} TransportOps;
+
+/* Transport struct definition - one client connection */
+struct Transport
+{
+    const TransportOps* ops;
+    int fd;
+    //the TLS session, NULL on a plain connection
+    void* ssl;
+    //the kernel encrypts what is sent (kTLS), so sendfile stays zero copy
+    bool ktls;
+    //the io_uring of the worker the connection goes through, NULL for system calls
+    struct UringIo* ring;
+    //longest a write may take
+    struct timeval write_timeout;
+};
+
+/* Transport mathods */
+int tlsLoad(char* cert, char* key);
+bool tlsEnabled();
+int transportOpen(Transport* t, int fd, struct timeval* deadline, struct timeval* write_timeout);
+ssize_t transportWriten(Transport* t, void* buf, size_t n);
+ssize_t transportWritevn(Transport* t, struct iovec* iov, int iovcnt);
+void transportClose(Transport* t);
+
+#endif //TRANSPORT_H
@@ -0,0 +1,604 @@
+//
+// uring.c: io_uring accept engine for the master thread.
+// One multishot accept request stays armed on the listening socket, and every
+// io_uring_enter call returns all the connections accepted since the last one,
+// instead of paying one accept() syscall per connection.
+// Used only when the kernel supports it - otherwise server.c falls back to Accept.
+//
+// Worker threads get a ring of their own for connection I/O (see UringIo): a
+// receive waits for data and its deadline in the same io_uring_enter, with no
+// poll before it, and a response goes out as a send of the header linked to
+// splices of the file, one io_uring_enter per pipe full.
+//
+
+#define _GNU_SOURCE
+
+#include <sys/syscall.h>
+#include "uring.h"
+
+/* Uring mathods implementation */
+
+static int uringSetup(unsigned entries, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+//
+// Submits the pending entries and waits for wait_nr completions until the
+// deadline, or for good if it is NULL. -1 with errno ETIME once the deadline passed
+//
+static int uringEnterUntil(Uring* u, unsigned wait_nr, struct timeval* deadline)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct timeval now, left;
+    int rc;
+
+    memset(&arg, 0, sizeof(arg));
+    if (deadline)
+    {
+        gettimeofday(&now, NULL);
+        timerclear(&left);
+        if (timercmp(&now, deadline, <))
+        {
+            timersub(deadline, &now, &left);
+        }
+        ts.tv_sec = left.tv_sec;
+        ts.tv_nsec = left.tv_usec * 1000;
+        arg.ts = (__u64)(uintptr_t)&ts;
+    }
+    rc = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, wait_nr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+        &arg, sizeof(arg));
+    if (rc > 0)
+    {
+        u->sq_pending -= rc;
+    }
+    return rc;
+}
+
+//
+// Creates a ring, NULL if io_uring is unavailable (old kernel, disabled by policy)
+//
+Uring* makeUring(unsigned entries)
+{
+    struct io_uring_params p;
+    Uring* u = (Uring*)malloc(sizeof(Uring));
+    if (!u)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    memset(u, 0, sizeof(Uring));
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = uringSetup(entries, &p)) < 0)
+    {
+        free(u);
+        return NULL;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(0, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(0, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(0, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED)
+    {
+        freeUring(u);
+        return NULL;
+    }
+
+    u->features = p.features;
+    u->sq_head = (unsigned*)((char*)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned*)((char*)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned*)((char*)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)((char*)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned*)((char*)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned*)((char*)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned*)((char*)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((char*)u->cq_ring + p.cq_off.cqes);
+    return u;
+}
+
+//
+// Returns a zeroed submission entry to fill in, NULL if the queue is full.
+// It is handed to the kernel by the next uringSubmitAndWait
+//
+struct io_uring_sqe* uringGetSqe(Uring* u)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *u->sq_tail;
+    struct io_uring_sqe* sqe;
+
+    if (tail - head > *u->sq_mask)
+    {
+        return NULL;
+    }
+    sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->sq_pending++;
+    return sqe;
+}
+
+//
+// Submits the pending entries and blocks until at least wait_nr completions are posted.
+// Returns the number of entries submitted, -1 on error
+//
+int uringSubmitAndWait(Uring* u, unsigned wait_nr)
+{
+    int rc;
+
+    do {
+        rc = uringEnter(u->fd, u->sq_pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (rc < 0 && errno == EINTR);
+    if (rc >= 0)
+    {
+        u->sq_pending -= rc;
+    }
+    return rc;
+}
+
+static bool uringArmAccept(Uring* u, int listenfd)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(u);
+    if (!sqe)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    //like the accept4 fallback, so CGI children do not inherit connections
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT_TAG;
+    return true;
+}
+
+//
+// Accepts connections on listenfd and hands them to the scheduler in batches.
+// Returns only if the ring stops working, the caller then falls back to Accept
+//
+void uringAcceptLoop(Uring* u, int listenfd, Scheduler* s)
+{
+    int backoff_ms = 0;
+
+    if (!uringArmAccept(u, listenfd))
+    {
+        return;
+    }
+    while (uringSubmitAndWait(u, 1) >= 0)
+    {
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        bool rearm = false, failed = false;
+        int connfds[SCHEDULE_ACCEPT_BATCH], num = 0;
+
+        //reap every completion posted so far
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+            if (cqe->user_data != URING_ACCEPT_TAG)
+            {
+                continue;
+            }
+            if (cqe->res == -EINVAL && !(cqe->flags & IORING_CQE_F_MORE))
+            {
+                //multishot accept not supported by this kernel
+                __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+                requestBatch(s, connfds, NULL, num);
+                return;
+            }
+            if (cqe->res >= 0)
+            {
+                connfds[num++] = cqe->res;
+            }
+            else
+            {
+                failed = true;
+            }
+            if (num == SCHEDULE_ACCEPT_BATCH)
+            {
+                requestBatch(s, connfds, NULL, num);
+                num = 0;
+            }
+            //the kernel ends a multishot request on errors and overflow
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                rearm = true;
+            }
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        //queue this round of connections under one lock acquisition
+        requestBatch(s, connfds, NULL, num);
+        if (!rearm)
+        {
+            continue;
+        }
+        //accept ended on an error (out of descriptors, say) - rearming right away
+        //would fail again at once, so wait longer each time it does, up to the limit
+        if (failed)
+        {
+            backoff_ms = backoff_ms ? backoff_ms * 2 : 1;
+            backoff_ms = backoff_ms < URING_ACCEPT_BACKOFF_MS ? backoff_ms : URING_ACCEPT_BACKOFF_MS;
+            usleep(backoff_ms * 1000);
+        }
+        else
+        {
+            backoff_ms = 0;
+        }
+        if (!uringArmAccept(u, listenfd))
+        {
+            return;
+        }
+    }
+}
+
+void freeUring(Uring* u)
+{
+    if (u)
+    {
+        if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        {
+            munmap(u->sq_ring, u->sq_ring_size);
+        }
+        if (u->cq_ring && u->cq_ring != MAP_FAILED)
+        {
+            munmap(u->cq_ring, u->cq_ring_size);
+        }
+        if (u->sqes && u->sqes != MAP_FAILED)
+        {
+            munmap(u->sqes, u->sqes_size);
+        }
+        close(u->fd);
+        free(u);
+    }
+}
+
+
+//hands buffer bid back to the kernel for the next receive
+static void uringPutBuffer(UringIo* io, int bid)
+{
+    unsigned short tail = io->buf_ring->tail;
+    struct io_uring_buf* b = &io->buf_ring->bufs[tail & (URING_IO_BUFFERS - 1)];
+
+    b->addr = (__u64)(uintptr_t)(io->bufs + bid * URING_IO_BUFFER_SIZE);
+    b->len = URING_IO_BUFFER_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&io->buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+//opens the pipe files are spliced through, as large as the kernel allows
+static bool uringOpenPipe(UringIo* io)
+{
+    int size;
+
+    if (pipe2(io->pipefd, O_CLOEXEC) < 0)
+    {
+        return false;
+    }
+    fcntl(io->pipefd[1], F_SETPIPE_SZ, URING_IO_PIPE_SIZE);
+    size = fcntl(io->pipefd[1], F_GETPIPE_SZ);
+    io->pipe_size = size > 0 ? size : 4096;
+    return true;
+}
+
+static void uringClosePipe(UringIo* io)
+{
+    close(io->pipefd[0]);
+    close(io->pipefd[1]);
+}
+
+//
+// Creates a connection ring, NULL if the kernel lacks what it takes:
+// deadlines on io_uring_enter (5.11) and provided buffer rings (5.19)
+//
+static UringIo* makeUringIo()
+{
+    struct io_uring_buf_reg reg;
+    UringIo* io = (UringIo*)malloc(sizeof(UringIo));
+
+    if (!io)
+    {
+        printf("Memmory allocation error! \n");
+        return NULL;
+    }
+    memset(io, 0, sizeof(UringIo));
+    if (!(io->ring = makeUring(URING_IO_ENTRIES)) || !(io->ring->features & IORING_FEAT_EXT_ARG))
+    {
+        freeUring(io->ring);
+        free(io);
+        return NULL;
+    }
+    //the buffer ring has to be page aligned
+    io->buf_ring = mmap(0, URING_IO_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    io->bufs = malloc(URING_IO_BUFFERS * URING_IO_BUFFER_SIZE);
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (__u64)(uintptr_t)io->buf_ring;
+    reg.ring_entries = URING_IO_BUFFERS;
+    reg.bgid = URING_IO_BGID;
+    if (io->buf_ring == MAP_FAILED || !io->bufs ||
+        syscall(__NR_io_uring_register, io->ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ||
+        !uringOpenPipe(io))
+    {
+        if (io->buf_ring != MAP_FAILED)
+        {
+            munmap(io->buf_ring, URING_IO_BUFFERS * sizeof(struct io_uring_buf));
+        }
+        free(io->bufs);
+        freeUring(io->ring);
+        free(io);
+        return NULL;
+    }
+    for (int i = 0; i < URING_IO_BUFFERS; i++)
+    {
+        uringPutBuffer(io, i);
+    }
+    return io;
+}
+
+//
+// Returns the connection ring of the calling thread, created on first use.
+// NULL if the kernel cannot provide one, connections then use plain system calls
+//
+UringIo* uringThreadIo()
+{
+    static __thread UringIo* io;
+    static __thread bool unavailable;
+
+    if (!io && !unavailable)
+    {
+        unavailable = !(io = makeUringIo());
+    }
+    return io;
+}
+
+//
+// Submits the num requests queued on the ring, tagged 0 .. num - 1, and copies
+// their completions to cqes. Requests still running at the deadline (NULL for
+// none) are cancelled, and complete with -ETIMEDOUT.
+// Returns 0 once all completed, -1 if the ring failed
+//
+static int uringRun(UringIo* io, struct io_uring_cqe* cqes, unsigned num, struct timeval* deadline)
+{
+    Uring* u = io->ring;
+    struct io_uring_sqe* sqe;
+    unsigned done = 0;
+    bool cancelled = false;
+
+    while (done < num)
+    {
+        if (uringEnterUntil(u, num - done, cancelled ? NULL : deadline) < 0)
+        {
+            if (errno == ETIME && !cancelled && (sqe = uringGetSqe(u)))
+            {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+                sqe->user_data = URING_CANCEL_TAG;
+                cancelled = true;
+            }
+            else if (errno != EINTR && errno != ETIME)
+            {
+                return -1;
+            }
+        }
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+            if (cqe->user_data < num)
+            {
+                cqes[cqe->user_data] = *cqe;
+                if (cancelled && cqe->res == -ECANCELED)
+                {
+                    cqes[cqe->user_data].res = -ETIMEDOUT;
+                }
+                done++;
+            }
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+//maps the completion of a request to the result of the matching system call
+static ssize_t uringResult(int res)
+{
+    if (res < 0)
+    {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+//
+// Receives up to n bytes from fd into buf, like recv, waiting until the
+// deadline (NULL for none). The kernel picks one of the provided buffers
+// once data is there, so no buffer is pinned while the client is silent
+//
+ssize_t uringRecv(UringIo* io, int fd, void* buf, size_t n, struct timeval* deadline)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(io->ring);
+    struct io_uring_cqe cqe;
+    int bid;
+
+    if (!sqe)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = n < URING_IO_BUFFER_SIZE ? n : URING_IO_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_IO_BGID;
+    sqe->user_data = 0;
+    if (uringRun(io, &cqe, 1, deadline) < 0)
+    {
+        return -1;
+    }
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+    {
+        bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe.res > 0)
+        {
+            memcpy(buf, io->bufs + bid * URING_IO_BUFFER_SIZE, cqe.res);
+        }
+        uringPutBuffer(io, bid);
+    }
+    return uringResult(cqe.res);
+}
+
+//fills sqe with a send of all of msg, more to follow if more is set
+static void uringPrepSendmsg(struct io_uring_sqe* sqe, int fd, struct msghdr* msg, bool more)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (__u64)(uintptr_t)msg;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+}
+
+//fills sqe with a splice of n bytes from in (at offset, -1 for a pipe) to out
+static void uringPrepSplice(struct io_uring_sqe* sqe, int in, off_t offset, int out, size_t n, bool more)
+{
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = in;
+    sqe->splice_off_in = offset;
+    sqe->fd = out;
+    sqe->off = (__u64)-1;
+    sqe->len = n;
+    sqe->splice_flags = SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0);
+}
+
+//
+// Sends all of iov to fd, like writev on a blocking socket, until the deadline
+//
+ssize_t uringSendmsg(UringIo* io, int fd, const struct iovec* iov, int iovcnt, struct timeval* deadline)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(io->ring);
+    struct io_uring_cqe cqe;
+    struct msghdr msg;
+
+    if (!sqe)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    uringPrepSendmsg(sqe, fd, &msg, false);
+    sqe->user_data = 0;
+    if (uringRun(io, &cqe, 1, deadline) < 0)
+    {
+        return -1;
+    }
+    return uringResult(cqe.res);
+}
+
+//splices n bytes that are in the pipe to fd, -errno on failure
+static int uringSpliceOut(UringIo* io, int fd, size_t n, bool more, struct timeval* deadline)
+{
+    struct io_uring_sqe* sqe = uringGetSqe(io->ring);
+    struct io_uring_cqe cqe;
+
+    if (!sqe)
+    {
+        return -EBUSY;
+    }
+    uringPrepSplice(sqe, io->pipefd[0], -1, fd, n, more);
+    sqe->user_data = 0;
+    if (uringRun(io, &cqe, 1, deadline) < 0)
+    {
+        return -errno;
+    }
+    return cqe.res;
+}
+
+//
+// Sends all of iov (iovcnt may be 0), then up to n bytes of srcfd from *offset,
+// to fd in one submission: the send linked to a splice of the file into the
+// pipe and one from the pipe to the socket. At most a pipe full of the file
+// goes per call. Returns the bytes of the file sent and advances *offset,
+// -1 if the send or the splices failed
+//
+ssize_t uringSendfile(UringIo* io, int fd, const struct iovec* iov, int iovcnt, int srcfd, off_t* offset, size_t n,
+    struct timeval* deadline)
+{
+    struct io_uring_sqe* sqe;
+    struct io_uring_cqe cqes[3];
+    struct msghdr msg;
+    size_t head = 0, chunk = n < io->pipe_size ? n : io->pipe_size;
+    unsigned num = 0;
+    int filled, sent, res;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        head += iov[i].iov_len;
+    }
+    if (head > 0)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec*)iov;
+        msg.msg_iovlen = iovcnt;
+        sqe = uringGetSqe(io->ring);
+        uringPrepSendmsg(sqe, fd, &msg, true);
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = num++;
+    }
+    sqe = uringGetSqe(io->ring);
+    uringPrepSplice(sqe, srcfd, *offset, io->pipefd[1], chunk, false);
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = num++;
+    sqe = uringGetSqe(io->ring);
+    uringPrepSplice(sqe, io->pipefd[0], -1, fd, chunk, chunk < n);
+    sqe->user_data = num++;
+    if (uringRun(io, cqes, num, deadline) < 0)
+    {
+        return -1;
+    }
+
+    //a short splice into the pipe breaks the link, and one out of it may be
+    //short too - what the pipe holds still goes out, a splice at a time
+    filled = cqes[num - 2].res;
+    res = cqes[num - 1].res == -ECANCELED ? 0 : cqes[num - 1].res;
+    sent = res > 0 ? res : 0;
+    while (res >= 0 && sent < filled)
+    {
+        res = uringSpliceOut(io, fd, filled - sent, chunk < n, deadline);
+        sent += res > 0 ? res : 0;
+        res = res ? res : -EPIPE;
+    }
+    //bytes of the file left in the pipe would go out with the next response
+    if (sent < filled)
+    {
+        uringClosePipe(io);
+        if (!uringOpenPipe(io))
+        {
+            //the ring cannot splice any more, fail the connections that try
+            io->pipefd[0] = io->pipefd[1] = -1;
+        }
+    }
+
+    if (head > 0 && cqes[0].res != head)
+    {
+        return uringResult(cqes[0].res < 0 ? cqes[0].res : -EPIPE);
+    }
+    if (filled <= 0)
+    {
+        //0 - the file got shorter than its size, like sendfile at its end
+        return uringResult(filled);
+    }
+    *offset += sent;
+    return sent > 0 ? sent : uringResult(res);
+}
@@ -0,0 +1,76 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include "segel.h"
+#include "scheduler.h"
+
+/* submission queue depth of the accept ring */
+#define URING_ENTRIES 256
+/* user_data tag of the multishot accept request */
+#define URING_ACCEPT_TAG 1
+/* longest pause before accepting again after accept failed, on EMFILE and the like (milliseconds) */
+#define URING_ACCEPT_BACKOFF_MS 100
+/* submission queue depth of a worker's connection ring, a response links at most 3 requests */
+#define URING_IO_ENTRIES 8
+/* receive buffers the kernel picks from, a power of 2, their size and buffer group id */
+#define URING_IO_BUFFERS 4
+#define URING_IO_BUFFER_SIZE RIO_BUFSIZE
+#define URING_IO_BGID 1
+/* pipe a file is spliced through on its way to the socket */
+#define URING_IO_PIPE_SIZE (256 * 1024)
+/* user_data tag of the cancellation of requests that missed their deadline */
+#define URING_CANCEL_TAG ((__u64)-1)
+
+/* Uring struct definition - a minimal io_uring instance driven by raw syscalls */
+typedef struct Uring
+{
+    int fd;
+    //submission queue ring
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    //sqes filled but not yet handed to the kernel
+    unsigned sq_pending;
+    //completion queue ring
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    //mappings to release
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    //IORING_FEAT_* of the kernel
+    unsigned features;
+} Uring;
+
+/* UringIo struct definition - the ring a worker thread moves connection bytes on.
+   Receives land in provided buffers, files are spliced to the socket through a pipe */
+typedef struct UringIo
+{
+    Uring* ring;
+    //provided buffer ring registered as URING_IO_BGID, and the buffers themselves
+    struct io_uring_buf_ring* buf_ring;
+    char* bufs;
+    int pipefd[2];
+    size_t pipe_size;
+} UringIo;
+
+/* Uring mathods */
+Uring* makeUring(unsigned entries);
+struct io_uring_sqe* uringGetSqe(Uring* u);
+int uringSubmitAndWait(Uring* u, unsigned wait_nr);
+void uringAcceptLoop(Uring* u, int listenfd, Scheduler* s);
+void freeUring(Uring* u);
+UringIo* uringThreadIo();
+ssize_t uringRecv(UringIo* io, int fd, void* buf, size_t n, struct timeval* deadline);
+ssize_t uringSendmsg(UringIo* io, int fd, const struct iovec* iov, int iovcnt, struct timeval* deadline);
+ssize_t uringSendfile(UringIo* io, int fd, const struct iovec* iov, int iovcnt, int srcfd, off_t* offset, size_t n,
+    struct timeval* deadline);
+
+#endif //URING_H
@@ -2,120 +2,367 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
-#include <cmath>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
 #include <sys/mman.h>
+#include <time.h>
 
 #define MAX_ORDER 10
+#define MIN_BLOCK_SHIFT 7
+#define MMAP_THRESHOLD 131072
+// the heap grows by aligned arenas of ARENA_BLOCKS blocks of MAX_ORDER
+#define ARENA_SHIFT 22
+#define ARENA_SIZE ((size_t) 1 << ARENA_SHIFT)
+#define ARENA_BLOCKS (ARENA_SIZE >> (MAX_ORDER + MIN_BLOCK_SHIFT))
+// one bit per buddy pair of every order below MAX_ORDER, which is less than a bit per minimal block
+#define BUDDY_BITS (ARENA_SIZE >> MIN_BLOCK_SHIFT)
+// arenas are found by address through a two level table, covering a 48 bit address space
+#define ARENA_MAP_LEAF_BITS 12
+#define ARENA_MAP_ROOT_BITS (48 - ARENA_SHIFT - ARENA_MAP_LEAF_BITS)
+// every thread caches freed blocks of up to TCACHE_MAX_ORDER, and moves them to and
+// from the shared heap TCACHE_BATCH at a time, keeping at most TCACHE_LIMIT per order
+#define TCACHE_MAX_ORDER 5
+#define TCACHE_BATCH 16
+#define TCACHE_LIMIT 64
+// requests of up to SLAB_MAX_SIZE bytes are served from slabs - blocks of SLAB_ORDER cut into
+// objects of one size class, without a header per object
+#define SLAB_ORDER 5
+#define SLAB_CLASSES 6
+#define SLAB_MAX_SIZE 96
+#define SLAB_MAP_WORDS 8
+// threads are spread over up to HEAPS_MAX heaps, one per CPU, each with its own lock and arenas
+#define HEAPS_MAX 16
+// freed mmap chunks are kept for reuse by their page rounded length, up to MMAP_CACHE_CHUNKS of
+// them and MMAP_CACHE_BYTES in all, and returned to the OS after MMAP_CACHE_DECAY seconds unused
+#define MMAP_CACHE_CHUNKS 32
+#define MMAP_CACHE_BYTES ((size_t) 64 << 20)
+#define MMAP_CACHE_DECAY 10
 
+// a single word in front of every block - the cookie is a hash of the block address
 struct MallocMetadata {
-    int cookie;
-    bool is_free =true;
-    size_t mmap_alloc_size = 0;
-    int order = 0;
-    MallocMetadata *next = nullptr;
-    MallocMetadata *prev = nullptr;
-    MallocMetadata *next_in_order = nullptr;
-    MallocMetadata *prev_in_order = nullptr;
+    uint32_t cookie;
+    uint8_t order;
+    bool is_free;
+    bool is_mmap;
+};
+
+// a free block keeps the links of its order list in its body, right after the metadata
+struct FreeLinks {
+    MallocMetadata *next;
+    MallocMetadata *prev;
+};
+
+// mmap chunks keep their size in a word before the metadata
+#define MMAP_HEADER (sizeof(size_t) + sizeof(MallocMetadata))
+
+struct Heap;
+
+struct CachedChunk {
+    char *chunk;
+    size_t length;
+    time_t freed;
+};
+
+struct MmapCache {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    CachedChunk chunks[MMAP_CACHE_CHUNKS];
+    int num_of_chunks = 0;
+    size_t num_of_bytes = 0;
+    time_t last_decay = 0;
+};
+
+struct Arena {
+    char *base;
+    Heap *heap;
+    // free blocks of MAX_ORDER, the arena is all free when there are ARENA_BLOCKS of them
+    int free_top_blocks;
+    // the bit of a buddy pair is set while exactly one of the two is free at the order of the pair
+    uint64_t buddy_bitmap[BUDDY_BITS / 64];
+    // a bit per block of SLAB_ORDER, set while the block is a slab - read by sfree without the lock
+    std::atomic<uint64_t> slab_map[(ARENA_SIZE >> (SLAB_ORDER + MIN_BLOCK_SHIFT)) / 64];
+};
+
+// lives in the block of the slab, right after its metadata, followed by the objects
+struct Slab {
+    int size_class;
+    int free_objects;
+    int objects;
+    // slabs with free objects are listed by their heap
+    Slab *next;
+    Slab *prev;
+    // a bit per object, set while it is free
+    uint64_t free_map[SLAB_MAP_WORDS];
+};
+
+struct TCache {
+    // cached blocks are free for their thread, and taken for the shared heap
+    MallocMetadata *bins[TCACHE_MAX_ORDER + 1] = {nullptr};
+    int counts[TCACHE_MAX_ORDER + 1] = {0};
+    // cached slab objects, linked through their first word
+    void *slab_bins[SLAB_CLASSES] = {nullptr};
+    int slab_counts[SLAB_CLASSES] = {0};
+    // written only by the owner thread, read by the stats of any thread
+    std::atomic<size_t> cached_blocks{0};
+    std::atomic<size_t> cached_bytes{0};
+    Heap *heap = nullptr;
+    bool registered = false;
+    TCache *next = nullptr;
+    TCache *prev = nullptr;
+    ~TCache();
+};
+
+struct alignas(64) Heap {
+    // guards everything below but remote_free, and the arenas of the heap
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    size_t num_of_free_bytes = 0;
+    size_t num_of_free_blocks = 0;
+    size_t num_of_alloc_blocks = 0;
+    size_t num_of_alloc_bytes = 0;
+    size_t num_of_mmap_blocks = 0;
+    MallocMetadata *orderBlocks[MAX_ORDER + 1] = {nullptr};
+    // bit i is set while orderBlocks[i] is not empty
+    unsigned int orderBitmap = 0;
+    size_t num_of_arenas = 0;
+    // all free arenas - one of them is kept, so a heap that grows and shrinks around an arena does not map it again and again
+    size_t num_of_empty_arenas = 0;
+    Slab *slabs[SLAB_CLASSES] = {nullptr};
+    // blocks and slab objects of this heap freed by threads of other heaps, linked through
+    // their first word - pushed without locking, taken by whoever holds lock
+    alignas(64) std::atomic<void *> remote_free{nullptr};
 };
 
 static int random_cookie = rand();
-bool orderBlocksInit = false;
-size_t num_of_free_bytes = 0;
-size_t num_of_free_blocks = 0;
-size_t num_of_alloc_blocks = 0;
-size_t num_of_alloc_bytes = 0;
-MallocMetadata *orderBlocks[11] = {nullptr};
-MallocMetadata *_memoryBlocks = nullptr;
-
-
-void orderListInsert(MallocMetadata *meta) {
-    MallocMetadata *head = orderBlocks[meta->order];
-    if (head == nullptr) {
-        meta->next_in_order = nullptr;
-        meta->prev_in_order = nullptr;
-        orderBlocks[meta->order] = meta;
-        return;
+const size_t slab_sizes[SLAB_CLASSES] = {8, 16, 32, 48, 64, 96};
+// the class of a size, by the size in 8 byte units
+const unsigned char slab_class_of[SLAB_MAX_SIZE / 8 + 1] = {0, 0, 1, 2, 2, 3, 3, 4, 4, 5, 5, 5, 5};
+Heap heaps[HEAPS_MAX];
+std::atomic<unsigned int> next_heap{0};
+// guards the list of thread caches
+pthread_mutex_t tcaches_lock = PTHREAD_MUTEX_INITIALIZER;
+TCache *tcaches = nullptr;
+thread_local TCache tcache;
+MmapCache mmap_cache;
+// guards the creation of arena map leaves, lookups do not lock
+pthread_mutex_t arena_map_lock = PTHREAD_MUTEX_INITIALIZER;
+Arena **arenaMap[(size_t) 1 << ARENA_MAP_ROOT_BITS] = {nullptr};
+
+static inline uint32_t blockCookie(MallocMetadata *meta) {
+    return (uint32_t) random_cookie ^ (uint32_t) (((uintptr_t) meta >> 3) * 0x9E3779B1u);
+}
+
+static inline FreeLinks *freeLinks(MallocMetadata *meta) {
+    return (FreeLinks *) (meta + 1);
+}
+
+static inline size_t &mmapSize(MallocMetadata *meta) {
+    return ((size_t *) meta)[-1];
+}
+
+static inline size_t pageRound(size_t size) {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+static inline size_t blockSize(int order) {
+    return (size_t) 1 << (order + MIN_BLOCK_SHIFT);
+}
+
+// smallest order whose block fits size bytes after the metadata, MAX_ORDER + 1 if none does
+static inline int sizeToOrder(size_t size) {
+    size_t total = size + sizeof(MallocMetadata);
+    if (total <= blockSize(0)) {
+        return 0;
     }
-    MallocMetadata *iter_curr = head;
-    while (iter_curr != nullptr) {
-        if (iter_curr->cookie != random_cookie) {
-            exit(0xdeadbeef);
-        }
-        if ((void *) iter_curr > (void *) meta) {
-            meta->next_in_order = iter_curr;
-            meta->prev_in_order = iter_curr->prev_in_order;
-            iter_curr->prev_in_order = meta;
-            if (meta->prev_in_order == nullptr) {
-                orderBlocks[meta->order] = meta;
-            }
-            else {
-                meta->prev_in_order->next_in_order = meta;
-            }
-            return;
-        }
-        else if (iter_curr->next_in_order == nullptr) {
-            iter_curr->next_in_order = meta;
-            meta->prev_in_order = iter_curr;
-            meta->next_in_order = nullptr;
-            return;
+    int order = (int) (sizeof(size_t) * 8 - __builtin_clzl(total - 1)) - MIN_BLOCK_SHIFT;
+    return order > MAX_ORDER ? MAX_ORDER + 1 : order;
+}
+
+static inline Arena *arenaOf(void *block) {
+    uintptr_t key = (uintptr_t) block >> ARENA_SHIFT;
+    Arena **leaf = arenaMap[key >> ARENA_MAP_LEAF_BITS];
+    return leaf == nullptr ? nullptr : leaf[key & ((1 << ARENA_MAP_LEAF_BITS) - 1)];
+}
+
+bool arenaMapSet(char *base, Arena *arena) {
+    uintptr_t key = (uintptr_t) base >> ARENA_SHIFT;
+    pthread_mutex_lock(&arena_map_lock);
+    Arena **&leaf = arenaMap[key >> ARENA_MAP_LEAF_BITS];
+    if (leaf == nullptr) {
+        void *ptr = mmap(NULL, sizeof(Arena *) << ARENA_MAP_LEAF_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == (void *) -1) {
+            pthread_mutex_unlock(&arena_map_lock);
+            return false;
         }
-        iter_curr = iter_curr->next_in_order;
+        leaf = (Arena **) ptr;
     }
+    leaf[key & ((1 << ARENA_MAP_LEAF_BITS) - 1)] = arena;
+    pthread_mutex_unlock(&arena_map_lock);
+    return true;
 }
 
-void orderListRemove(MallocMetadata *meta) {
-    MallocMetadata *head = orderBlocks[meta->order];
-    MallocMetadata *iter = head;
-    while (iter != nullptr) {
-        if (iter->cookie != random_cookie) {
-            exit(0xdeadbeef);
-        }
-        if (iter == meta) {
-            if (iter->prev_in_order == nullptr) {
-                orderBlocks[meta->order] = iter->next_in_order;
-            } else {
-                iter->prev_in_order->next_in_order = iter->next_in_order;
-            }
-            if (iter->next_in_order != nullptr) {
-                iter->next_in_order->prev_in_order = iter->prev_in_order;
-            }
-            return;
+static int heapsNum() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : (cpus > HEAPS_MAX ? HEAPS_MAX : (int) cpus);
+}
+
+// the heap of the calling thread, threads are handed heaps round robin
+static inline Heap *threadHeap() {
+    if (tcache.heap == nullptr) {
+        static const int num_of_heaps = heapsNum();
+        tcache.heap = &heaps[next_heap.fetch_add(1, std::memory_order_relaxed) % num_of_heaps];
+    }
+    return tcache.heap;
+}
+
+// the pairs of an order come after the pairs of all lower orders
+static inline size_t buddyBit(Arena *arena, void *block, int order) {
+    size_t offset = (char *) block - arena->base;
+    size_t first = (ARENA_SIZE >> MIN_BLOCK_SHIFT) - (ARENA_SIZE >> (MIN_BLOCK_SHIFT + order));
+    return first + (offset >> (MIN_BLOCK_SHIFT + 1 + order));
+}
+
+static inline void buddyToggle(Arena *arena, void *block, int order) {
+    size_t bit = buddyBit(arena, block, order);
+    arena->buddy_bitmap[bit / 64] ^= (uint64_t) 1 << (bit % 64);
+}
+
+// whether one block of the pair is free at order and the other is not, without reading either
+static inline bool buddyDiffers(Arena *arena, void *block, int order) {
+    size_t bit = buddyBit(arena, block, order);
+    return (arena->buddy_bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+// keeps the arena of a block that became free, or stopped being free, at its order up to date
+static inline void arenaUpdate(Heap *heap, MallocMetadata *meta, int free_change) {
+    Arena *arena = arenaOf(meta);
+    if (meta->order < MAX_ORDER) {
+        buddyToggle(arena, meta, meta->order);
+        return;
+    }
+    if (arena->free_top_blocks == (int) ARENA_BLOCKS) {
+        heap->num_of_empty_arenas--;
+    }
+    arena->free_top_blocks += free_change;
+    if (arena->free_top_blocks == (int) ARENA_BLOCKS) {
+        heap->num_of_empty_arenas++;
+    }
+}
+
+
+// free blocks of an order are kept in LIFO order - the last block split or freed is the first reused
+void orderListInsert(Heap *heap, MallocMetadata *meta) {
+    MallocMetadata *head = heap->orderBlocks[meta->order];
+    freeLinks(meta)->prev = nullptr;
+    freeLinks(meta)->next = head;
+    if (head != nullptr) {
+        freeLinks(head)->prev = meta;
+    }
+    heap->orderBlocks[meta->order] = meta;
+    heap->orderBitmap |= 1u << meta->order;
+    arenaUpdate(heap, meta, 1);
+}
+
+void orderListRemove(Heap *heap, MallocMetadata *meta) {
+    FreeLinks *links = freeLinks(meta);
+    if (links->prev == nullptr) {
+        heap->orderBlocks[meta->order] = links->next;
+        if (links->next == nullptr) {
+            heap->orderBitmap &= ~(1u << meta->order);
         }
-        iter = iter->next_in_order;
+    } else {
+        freeLinks(links->prev)->next = links->next;
+    }
+    if (links->next != nullptr) {
+        freeLinks(links->next)->prev = links->prev;
     }
+    arenaUpdate(heap, meta, -1);
 }
 
-MallocMetadata *mergeBlocks(MallocMetadata *meta1, MallocMetadata *meta2) {
+// maps a new arena and adds its blocks to the free lists of heap
+Arena *arenaCreate(Heap *heap) {
+    // twice the size, to cut an aligned arena out of it
+    void *ptr = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == (void *) -1) {
+        return nullptr;
+    }
+    char *base = (char *) (((uintptr_t) ptr + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1));
+    if (base != (char *) ptr) {
+        munmap(ptr, base - (char *) ptr);
+    }
+    munmap(base + ARENA_SIZE, (char *) ptr + ARENA_SIZE - base);
+    ptr = mmap(NULL, sizeof(Arena), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == (void *) -1) {
+        munmap(base, ARENA_SIZE);
+        return nullptr;
+    }
+    Arena *arena = (Arena *) ptr;
+    arena->base = base;
+    arena->heap = heap;
+    arena->free_top_blocks = 0;
+    if (!arenaMapSet(base, arena)) {
+        munmap(arena, sizeof(Arena));
+        munmap(base, ARENA_SIZE);
+        return nullptr;
+    }
+    for (int i = ARENA_BLOCKS - 1; i >= 0; i--) {
+        MallocMetadata *iter = (MallocMetadata *) (base + i * blockSize(MAX_ORDER));
+        iter->is_free = true;
+        iter->order = MAX_ORDER;
+        iter->cookie = blockCookie(iter);
+        iter->is_mmap = false;
+        orderListInsert(heap, iter);
+    }
+    heap->num_of_arenas++;
+    heap->num_of_alloc_blocks += ARENA_BLOCKS;
+    heap->num_of_free_blocks += ARENA_BLOCKS;
+    heap->num_of_alloc_bytes += ARENA_BLOCKS * (blockSize(MAX_ORDER) - sizeof(MallocMetadata));
+    heap->num_of_free_bytes += ARENA_BLOCKS * (blockSize(MAX_ORDER) - sizeof(MallocMetadata));
+    return arena;
+}
+
+// returns an all free arena to the OS
+void arenaRelease(Heap *heap, Arena *arena) {
+    for (size_t i = 0; i < ARENA_BLOCKS; i++) {
+        orderListRemove(heap, (MallocMetadata *) (arena->base + i * blockSize(MAX_ORDER)));
+    }
+    heap->num_of_arenas--;
+    heap->num_of_alloc_blocks -= ARENA_BLOCKS;
+    heap->num_of_free_blocks -= ARENA_BLOCKS;
+    heap->num_of_alloc_bytes -= ARENA_BLOCKS * (blockSize(MAX_ORDER) - sizeof(MallocMetadata));
+    heap->num_of_free_bytes -= ARENA_BLOCKS * (blockSize(MAX_ORDER) - sizeof(MallocMetadata));
+    arenaMapSet(arena->base, nullptr);
+    munmap(arena->base, ARENA_SIZE);
+    munmap(arena, sizeof(Arena));
+}
+
+MallocMetadata *mergeBlocks(Heap *heap, MallocMetadata *meta1, MallocMetadata *meta2) {
     if(meta1 == nullptr || meta2 == nullptr)
     {
         return nullptr;
     }
-    orderListRemove(meta1);
-    orderListRemove(meta2);
-    num_of_free_blocks--;
-    num_of_free_bytes += sizeof(MallocMetadata);
-    num_of_alloc_blocks--;
-    num_of_alloc_bytes += sizeof(MallocMetadata);
+    orderListRemove(heap, meta1);
+    orderListRemove(heap, meta2);
+    heap->num_of_free_blocks--;
+    heap->num_of_free_bytes += sizeof(MallocMetadata);
+    heap->num_of_alloc_blocks--;
+    heap->num_of_alloc_bytes += sizeof(MallocMetadata);
     if (meta1 > meta2) {
         MallocMetadata *tmp = meta1;
         meta1 = meta2;
         meta2 = tmp;
     }
-    meta1->next = meta2->next;
-    if (meta2->next != nullptr) {
-        meta2->next->prev = meta1;
-    }
     meta1->order = meta1->order + 1;
-    orderListInsert(meta1);
+    orderListInsert(heap, meta1);
     return meta1;
 }
 
-MallocMetadata *splitBlocks(MallocMetadata *to_split) {
+MallocMetadata *splitBlocks(Heap *heap, MallocMetadata *to_split) {
     if(to_split == nullptr)
     {
         return nullptr;
     }
-    if(to_split->cookie != random_cookie)
+    if(to_split->cookie != blockCookie(to_split))
     {
         exit(0xdeadbeef);
     }
@@ -123,161 +370,492 @@ MallocMetadata *splitBlocks(MallocMetadata *to_split) {
     {
         return to_split;
     }
-    num_of_free_blocks++;
-    num_of_free_bytes -= sizeof(MallocMetadata);
-    num_of_alloc_blocks++;
-    num_of_alloc_bytes -= sizeof(MallocMetadata);
-    orderListRemove(to_split);
-    MallocMetadata *new_meta = (MallocMetadata *) (void *) ((char *) to_split + (int)(128 * pow(2,(to_split->order - 1))));
+    heap->num_of_free_blocks++;
+    heap->num_of_free_bytes -= sizeof(MallocMetadata);
+    heap->num_of_alloc_blocks++;
+    heap->num_of_alloc_bytes -= sizeof(MallocMetadata);
+    orderListRemove(heap, to_split);
+    MallocMetadata *new_meta = (MallocMetadata *) (void *) ((char *) to_split + blockSize(to_split->order - 1));
     to_split->order = to_split->order - 1;
     new_meta->order = to_split->order;
-    new_meta->cookie = random_cookie;
+    new_meta->cookie = blockCookie(new_meta);
     new_meta->is_free = true;
+    new_meta->is_mmap = false;
     to_split->is_free = true;
-    new_meta->next = to_split->next;
-    new_meta->prev = to_split;
-    to_split->next = new_meta;
-    if (new_meta->next != nullptr)
-    {
-        new_meta->next->prev = new_meta;
-    }
-    orderListInsert(new_meta);
-    orderListInsert(to_split);
+    orderListInsert(heap, new_meta);
+    orderListInsert(heap, to_split);
     return to_split;
 }
 
-MallocMetadata *memorySplit(size_t size, MallocMetadata *meta = nullptr) {
-    MallocMetadata *iter = nullptr;
-    int order = -1;
-    if (meta == nullptr) {
-        for (int i = 0; i <= MAX_ORDER; i++) {
-            iter = orderBlocks[i];
-            if (iter == nullptr || size > (size_t)((128 * pow(2,i)) - sizeof(MallocMetadata))) {
-                continue;
-            }
-            else{
-                order = iter->order;
-                if(order == 0 || size > (size_t)((128 * pow(2,(order - 1))) - sizeof(MallocMetadata)))
-                {
-                    if (iter->cookie != random_cookie) {
-                        exit(0xdeadbeef);
-                    }
-                    return iter;
-                }
-                break;
-            }
-        }
-        if(order == -1)
-        {
+MallocMetadata *memorySplit(Heap *heap, int order) {
+    // the non empty orders that are large enough, the smallest of them is split down
+    unsigned int available = heap->orderBitmap >> order;
+    if (available == 0) {
+        if (arenaCreate(heap) == nullptr) {
             return nullptr;
         }
+        available = heap->orderBitmap >> order;
     }
-    else
-    {
-        if (meta->cookie != random_cookie)
-        {
-            exit(0xdeadbeef);
-        }
-        order = meta->order;
-        if(order == 0 || size > (size_t)((128 * pow(2,(order - 1))) - sizeof(MallocMetadata)))
-        {
-            return meta;
-        }
+    MallocMetadata *block = heap->orderBlocks[order + __builtin_ctz(available)];
+    if (block->cookie != blockCookie(block)) {
+        exit(0xdeadbeef);
     }
-    for (int j = order; j > 0; j--) {
-        iter = splitBlocks( iter);
-        if (iter == nullptr) {
-            return nullptr;
-        }
-        else if ((size > (size_t)(128 * pow(2,(iter->order - 1)) - sizeof(MallocMetadata)) || iter->order == 0))
-        {
-            return iter;
-        }
+    while (block->order > order) {
+        block = splitBlocks(heap, block);
     }
-    return meta;
+    return block;
 }
 
-MallocMetadata *memoryMerge(MallocMetadata *meta) {
-    if (meta->cookie != random_cookie) {
+MallocMetadata *memoryMerge(Heap *heap, MallocMetadata *meta) {
+    if (meta->cookie != blockCookie(meta)) {
         exit(0xdeadbeef);
     }
+    Arena *arena = arenaOf(meta);
     MallocMetadata *iter = meta;
     MallocMetadata *buddy;
-    for (int i = meta->order; i < MAX_ORDER; i++) {
-        buddy = (MallocMetadata *) ((void *) ((std::uintptr_t) iter ^ (int)(128 * pow(2,(iter->order)))));
-        if (meta->order != buddy->order || !buddy->is_free)
-        {
-            return meta;
-        }
-        iter = mergeBlocks(iter, buddy);
+    // iter is free, so its buddy is free at the same order when the pair does not differ
+    while (iter->order < MAX_ORDER && !buddyDiffers(arena, iter, iter->order)) {
+        buddy = (MallocMetadata *) ((void *) ((std::uintptr_t) iter ^ blockSize(iter->order)));
+        iter = mergeBlocks(heap, iter, buddy);
+    }
+    if (arena->free_top_blocks == (int) ARENA_BLOCKS && heap->num_of_empty_arenas > 1) {
+        arenaRelease(heap, arena);
+        return nullptr;
     }
     return iter;
 }
 
 size_t _sizeOfBlock(MallocMetadata *block) {
-    return 128 * (int)pow(2,block->order);
+    return blockSize(block->order);
 }
 
-void *smalloc(size_t size) {
-    if (!orderBlocksInit) {
-        void *block_ptr = sbrk(0);
-        size_t align = (32 * 131072) - (((uintptr_t) block_ptr) % (32 * 131072));
-        if (sbrk((32 * 131072) + align) == (void *) -1) {
-            return nullptr;
+// takes a block of order off heap, with its lock held
+MallocMetadata *buddyAlloc(Heap *heap, int order) {
+    MallocMetadata *block = memorySplit(heap, order);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    block->is_free = false;
+    orderListRemove(heap, block);
+    heap->num_of_free_blocks--;
+    heap->num_of_free_bytes -= (blockSize(block->order) - sizeof(MallocMetadata));
+    return block;
+}
+
+// returns a block to heap, with its lock held
+void buddyFree(Heap *heap, MallocMetadata *meta) {
+    meta->is_free = true;
+    heap->num_of_free_blocks++;
+    heap->num_of_free_bytes += (_sizeOfBlock(meta) - sizeof(MallocMetadata));
+    orderListInsert(heap, meta);
+    memoryMerge(heap, meta);
+}
+
+static inline bool isSlabObject(Arena *arena, void *p) {
+    size_t block = (size_t) ((char *) p - arena->base) >> (SLAB_ORDER + MIN_BLOCK_SHIFT);
+    return (arena->slab_map[block / 64].load(std::memory_order_relaxed) >> (block % 64)) & 1;
+}
+
+static inline Slab *slabOf(void *p) {
+    uintptr_t block = (uintptr_t) p & ~(blockSize(SLAB_ORDER) - 1);
+    return (Slab *) (block + sizeof(MallocMetadata));
+}
+
+static inline char *slabObjects(Slab *slab) {
+    // 16 byte aligned within the block
+    return (char *) slab - sizeof(MallocMetadata) + ((sizeof(MallocMetadata) + sizeof(Slab) + 15) & ~(size_t) 15);
+}
+
+static inline void slabMark(void *block, bool slab) {
+    Arena *arena = arenaOf(block);
+    size_t index = (size_t) ((char *) block - arena->base) >> (SLAB_ORDER + MIN_BLOCK_SHIFT);
+    if (slab) {
+        arena->slab_map[index / 64].fetch_or((uint64_t) 1 << (index % 64), std::memory_order_relaxed);
+    }
+    else {
+        arena->slab_map[index / 64].fetch_and(~((uint64_t) 1 << (index % 64)), std::memory_order_relaxed);
+    }
+}
+
+static inline void slabListInsert(Heap *heap, Slab *slab) {
+    slab->prev = nullptr;
+    slab->next = heap->slabs[slab->size_class];
+    if (slab->next != nullptr) {
+        slab->next->prev = slab;
+    }
+    heap->slabs[slab->size_class] = slab;
+}
+
+static inline void slabListRemove(Heap *heap, Slab *slab) {
+    if (slab->prev == nullptr) {
+        heap->slabs[slab->size_class] = slab->next;
+    } else {
+        slab->prev->next = slab->next;
+    }
+    if (slab->next != nullptr) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// cuts a new block of heap into objects of size_class, with the heap lock held
+Slab *slabCreate(Heap *heap, int size_class) {
+    MallocMetadata *block = buddyAlloc(heap, SLAB_ORDER);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    slabMark(block, true);
+    Slab *slab = (Slab *) ((char *) block + sizeof(MallocMetadata));
+    size_t room = (char *) block + blockSize(SLAB_ORDER) - slabObjects(slab);
+    slab->size_class = size_class;
+    slab->objects = room / slab_sizes[size_class];
+    if (slab->objects > SLAB_MAP_WORDS * 64) {
+        slab->objects = SLAB_MAP_WORDS * 64;
+    }
+    slab->free_objects = slab->objects;
+    for (int i = 0; i < SLAB_MAP_WORDS; i++) {
+        int bits = slab->objects - i * 64;
+        slab->free_map[i] = bits >= 64 ? ~(uint64_t) 0 : (bits > 0 ? ((uint64_t) 1 << bits) - 1 : 0);
+    }
+    slabListInsert(heap, slab);
+    return slab;
+}
+
+// takes a free object of size_class - the first set bit of a slab with free objects
+void *slabAlloc(Heap *heap, int size_class) {
+    Slab *slab = heap->slabs[size_class];
+    if (slab == nullptr && (slab = slabCreate(heap, size_class)) == nullptr) {
+        return nullptr;
+    }
+    int word = 0;
+    while (slab->free_map[word] == 0) {
+        word++;
+    }
+    int index = word * 64 + __builtin_ctzll(slab->free_map[word]);
+    slab->free_map[word] &= slab->free_map[word] - 1;
+    if (--slab->free_objects == 0) {
+        slabListRemove(heap, slab);
+    }
+    return slabObjects(slab) + index * slab_sizes[slab->size_class];
+}
+
+// a slab left all free goes back to the buddy heap, unless it is the last one with free objects
+void slabFree(Heap *heap, void *p) {
+    Slab *slab = slabOf(p);
+    size_t index = (size_t) ((char *) p - slabObjects(slab)) / slab_sizes[slab->size_class];
+    slab->free_map[index / 64] |= (uint64_t) 1 << (index % 64);
+    if (slab->free_objects++ == 0) {
+        slabListInsert(heap, slab);
+    }
+    if (slab->free_objects == slab->objects && (slab->next != nullptr || slab->prev != nullptr)) {
+        slabListRemove(heap, slab);
+        MallocMetadata *block = (MallocMetadata *) ((char *) slab - sizeof(MallocMetadata));
+        slabMark(block, false);
+        buddyFree(heap, block);
+    }
+}
+
+// frees a block or slab object of heap, with its lock held
+void localFree(Heap *heap, void *p) {
+    if (isSlabObject(arenaOf(p), p)) {
+        slabFree(heap, p);
+    }
+    else {
+        buddyFree(heap, (MallocMetadata *) ((char *) p - sizeof(MallocMetadata)));
+    }
+}
+
+// hands a block or slab object to the heap that owns it, without waiting for its lock
+static inline void remoteFree(Heap *heap, void *p) {
+    void *head = heap->remote_free.load(std::memory_order_relaxed);
+    do {
+        *(void **) p = head;
+    } while (!heap->remote_free.compare_exchange_weak(head, p, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// frees what other threads handed to heap, with its lock held
+void remoteDrain(Heap *heap) {
+    if (heap->remote_free.load(std::memory_order_relaxed) == nullptr) {
+        return;
+    }
+    void *iter = heap->remote_free.exchange(nullptr, std::memory_order_acquire);
+    while (iter != nullptr) {
+        void *next = *(void **) iter;
+        localFree(heap, iter);
+        iter = next;
+    }
+}
+
+// frees a block or slab object from the calling thread, which holds the lock of its own heap
+static inline void ownerFree(Heap *heap, void *p) {
+    Heap *owner = arenaOf(p)->heap;
+    if (owner == heap) {
+        localFree(heap, p);
+    }
+    else {
+        remoteFree(owner, p);
+    }
+}
+
+static inline void tcacheCount(long blocks, long bytes) {
+    tcache.cached_blocks.store(tcache.cached_blocks.load(std::memory_order_relaxed) + blocks, std::memory_order_relaxed);
+    tcache.cached_bytes.store(tcache.cached_bytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+}
+
+// links the cache of the thread into tcaches on its first block, so the stats count what it holds
+static inline void tcacheRegister() {
+    if (tcache.registered) {
+        return;
+    }
+    pthread_mutex_lock(&tcaches_lock);
+    tcache.next = tcaches;
+    if (tcaches != nullptr) {
+        tcaches->prev = &tcache;
+    }
+    tcaches = &tcache;
+    tcache.registered = true;
+    pthread_mutex_unlock(&tcaches_lock);
+}
+
+static inline void tcachePush(MallocMetadata *meta) {
+    tcacheRegister();
+    freeLinks(meta)->next = tcache.bins[meta->order];
+    tcache.bins[meta->order] = meta;
+    tcache.counts[meta->order]++;
+    tcacheCount(1, _sizeOfBlock(meta) - sizeof(MallocMetadata));
+}
+
+static inline MallocMetadata *tcachePop(int order) {
+    MallocMetadata *meta = tcache.bins[order];
+    tcache.bins[order] = freeLinks(meta)->next;
+    tcache.counts[order]--;
+    tcacheCount(-1, -(long) (_sizeOfBlock(meta) - sizeof(MallocMetadata)));
+    return meta;
+}
+
+// fills an empty bin with a batch of blocks from the heap of the thread
+void tcacheRefill(int order) {
+    Heap *heap = threadHeap();
+    // before the heap lock, the pushes below find the cache registered
+    tcacheRegister();
+    pthread_mutex_lock(&heap->lock);
+    remoteDrain(heap);
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+        MallocMetadata *block = buddyAlloc(heap, order);
+        if (block == nullptr) {
+            break;
         }
-        block_ptr = (void *) ((char *) block_ptr + align);
-        orderBlocks[MAX_ORDER] = (MallocMetadata *) block_ptr;
-        MallocMetadata *iter = orderBlocks[MAX_ORDER];
-        iter->is_free = true;
-        iter->order = MAX_ORDER;
-        iter->cookie = random_cookie;
-        iter->prev_in_order = nullptr;
-        iter->prev = nullptr;
-        for (int i = 0; i < 31; i++) {
-            iter->next = (MallocMetadata *) ((char *) iter + 131072);
-            iter->next->prev = iter;
-            iter->next_in_order = iter->next;
-            iter->next_in_order->prev_in_order = iter;
-            iter = iter->next;
-            iter->order = MAX_ORDER;
-            iter->is_free = true;
-            iter->cookie = random_cookie;
+        block->is_free = true;
+        tcachePush(block);
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+// returns the blocks of a bin to the heaps they came from, all but keep of them
+void tcacheFlush(int order, int keep) {
+    Heap *heap = threadHeap();
+    pthread_mutex_lock(&heap->lock);
+    while (tcache.counts[order] > keep) {
+        ownerFree(heap, (char *) tcachePop(order) + sizeof(MallocMetadata));
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+// fills an empty slab bin with a batch of objects from the heap of the thread
+void tcacheSlabRefill(int size_class) {
+    Heap *heap = threadHeap();
+    pthread_mutex_lock(&heap->lock);
+    remoteDrain(heap);
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+        void *p = slabAlloc(heap, size_class);
+        if (p == nullptr) {
+            break;
+        }
+        *(void **) p = tcache.slab_bins[size_class];
+        tcache.slab_bins[size_class] = p;
+        tcache.slab_counts[size_class]++;
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+// returns the objects of a slab bin to the heaps they came from, all but keep of them
+void tcacheSlabFlush(int size_class, int keep) {
+    Heap *heap = threadHeap();
+    pthread_mutex_lock(&heap->lock);
+    while (tcache.slab_counts[size_class] > keep) {
+        void *p = tcache.slab_bins[size_class];
+        tcache.slab_bins[size_class] = *(void **) p;
+        tcache.slab_counts[size_class]--;
+        ownerFree(heap, p);
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+TCache::~TCache() {
+    for (int i = 0; i <= TCACHE_MAX_ORDER; i++) {
+        if (counts[i] > 0) {
+            tcacheFlush(i, 0);
+        }
+    }
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        if (slab_counts[i] > 0) {
+            tcacheSlabFlush(i, 0);
+        }
+    }
+    if (registered) {
+        pthread_mutex_lock(&tcaches_lock);
+        if (prev == nullptr) {
+            tcaches = next;
+        } else {
+            prev->next = next;
+        }
+        if (next != nullptr) {
+            next->prev = prev;
+        }
+        registered = false;
+        pthread_mutex_unlock(&tcaches_lock);
+    }
+}
+
+static inline CachedChunk mmapCacheRemove(int i) {
+    CachedChunk removed = mmap_cache.chunks[i];
+    mmap_cache.chunks[i] = mmap_cache.chunks[--mmap_cache.num_of_chunks];
+    mmap_cache.num_of_bytes -= removed.length;
+    return removed;
+}
+
+// moves the chunks unused for MMAP_CACHE_DECAY seconds to expired, at most once a second,
+// with the cache lock held. Returns how many were moved
+static int mmapCacheDecay(time_t now, CachedChunk *expired) {
+    int num = 0;
+    if (now == mmap_cache.last_decay) {
+        return 0;
+    }
+    mmap_cache.last_decay = now;
+    for (int i = 0; i < mmap_cache.num_of_chunks;) {
+        if (now - mmap_cache.chunks[i].freed >= MMAP_CACHE_DECAY) {
+            expired[num++] = mmapCacheRemove(i);
+        }
+        else {
+            i++;
+        }
+    }
+    return num;
+}
+
+static void mmapCacheRelease(CachedChunk *chunks, int num) {
+    for (int i = 0; i < num; i++) {
+        munmap(chunks[i].chunk, chunks[i].length);
+    }
+}
+
+// a cached chunk of length bytes, nullptr if there is none
+void *mmapCacheTake(size_t length) {
+    CachedChunk expired[MMAP_CACHE_CHUNKS];
+    void *chunk = nullptr;
+    pthread_mutex_lock(&mmap_cache.lock);
+    int num = mmapCacheDecay(time(nullptr), expired);
+    for (int i = 0; i < mmap_cache.num_of_chunks; i++) {
+        if (mmap_cache.chunks[i].length == length) {
+            chunk = mmapCacheRemove(i).chunk;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mmap_cache.lock);
+    mmapCacheRelease(expired, num);
+    return chunk;
+}
+
+// keeps a freed chunk for reuse, making room by returning the chunks freed the longest ago.
+// Its pages stay mapped, but the kernel may take them back under memory pressure (MADV_FREE)
+void mmapCachePut(char *chunk, size_t length) {
+    if (length > MMAP_CACHE_BYTES / 4) {
+        munmap(chunk, length);
+        return;
+    }
+#ifdef MADV_FREE
+    madvise(chunk, length, MADV_FREE);
+#endif
+    CachedChunk expired[MMAP_CACHE_CHUNKS];
+    time_t now = time(nullptr);
+    pthread_mutex_lock(&mmap_cache.lock);
+    int num = mmapCacheDecay(now, expired);
+    while (mmap_cache.num_of_chunks == MMAP_CACHE_CHUNKS || mmap_cache.num_of_bytes + length > MMAP_CACHE_BYTES) {
+        int oldest = 0;
+        for (int i = 1; i < mmap_cache.num_of_chunks; i++) {
+            if (mmap_cache.chunks[i].freed < mmap_cache.chunks[oldest].freed) {
+                oldest = i;
+            }
         }
-        iter->next_in_order = nullptr;
-        iter->next = nullptr;
-        num_of_alloc_blocks += 32;
-        num_of_free_blocks += 32;
-        num_of_alloc_bytes += 32 * (131072 - sizeof(MallocMetadata));
-        num_of_free_bytes += 32 * (131072 - sizeof(MallocMetadata));
-        orderBlocksInit = true;
+        expired[num++] = mmapCacheRemove(oldest);
     }
+    mmap_cache.chunks[mmap_cache.num_of_chunks++] = {chunk, length, now};
+    mmap_cache.num_of_bytes += length;
+    pthread_mutex_unlock(&mmap_cache.lock);
+    mmapCacheRelease(expired, num);
+}
+
+void *smalloc(size_t size) {
     if (size == 0 || size > 100000000) {
         return nullptr;
     }
-    if (size >= 131072) {
-        void *ptr = mmap(NULL, size + sizeof(MallocMetadata), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (ptr == (void *) -1) {
-            return nullptr;
+    if (size <= SLAB_MAX_SIZE) {
+        int size_class = slab_class_of[(size + 7) / 8];
+        if (tcache.slab_bins[size_class] == nullptr) {
+            tcacheSlabRefill(size_class);
+            if (tcache.slab_bins[size_class] == nullptr) {
+                return nullptr;
+            }
+        }
+        void *p = tcache.slab_bins[size_class];
+        tcache.slab_bins[size_class] = *(void **) p;
+        tcache.slab_counts[size_class]--;
+        return p;
+    }
+    int order = sizeToOrder(size);
+    Heap *heap = threadHeap();
+    if (size >= MMAP_THRESHOLD || order > MAX_ORDER) {
+        size_t length = pageRound(size + MMAP_HEADER);
+        void *ptr = mmapCacheTake(length);
+        if (ptr == nullptr) {
+            ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == (void *) -1) {
+                return nullptr;
+            }
         }
-        MallocMetadata *meta = (MallocMetadata *) ptr;
-        meta->cookie = random_cookie;
-        meta->mmap_alloc_size = size;
+        MallocMetadata *meta = (MallocMetadata *) ((char *) ptr + sizeof(size_t));
+        meta->cookie = blockCookie(meta);
+        meta->order = 0;
         meta->is_free = false;
-        num_of_alloc_bytes += size;
-        num_of_alloc_blocks++;
+        meta->is_mmap = true;
+        mmapSize(meta) = size;
+        pthread_mutex_lock(&heap->lock);
+        heap->num_of_alloc_bytes += size;
+        heap->num_of_alloc_blocks++;
+        heap->num_of_mmap_blocks++;
+        pthread_mutex_unlock(&heap->lock);
         return (void *) ((char *) meta + sizeof(MallocMetadata));
     }
+    MallocMetadata *block;
+    if (order <= TCACHE_MAX_ORDER) {
+        if (tcache.bins[order] == nullptr) {
+            tcacheRefill(order);
+            if (tcache.bins[order] == nullptr) {
+                return nullptr;
+            }
+        }
+        block = tcachePop(order);
+        block->is_free = false;
+    }
     else {
-        MallocMetadata *block = memorySplit(size);
+        pthread_mutex_lock(&heap->lock);
+        remoteDrain(heap);
+        block = buddyAlloc(heap, order);
+        pthread_mutex_unlock(&heap->lock);
         if (block == nullptr) {
             return nullptr;
         }
-        block->is_free = false;
-        orderListRemove(block);
-        num_of_free_blocks--;
-        num_of_free_bytes -= ((int)pow(2,block->order) * 128 - sizeof(MallocMetadata));
-        return (void *) ((char *) block + sizeof(MallocMetadata));
     }
+    return (void *) ((char *) block + sizeof(MallocMetadata));
 }
 
 void *scalloc(size_t num, size_t size) {
@@ -294,26 +872,76 @@ void sfree(void *p) {
     {
         return;
     }
+    Arena *arena = arenaOf(p);
+    if (arena != nullptr && isSlabObject(arena, p)) {
+        int size_class = slabOf(p)->size_class;
+        *(void **) p = tcache.slab_bins[size_class];
+        tcache.slab_bins[size_class] = p;
+        if (++tcache.slab_counts[size_class] > TCACHE_LIMIT) {
+            tcacheSlabFlush(size_class, TCACHE_LIMIT / 2);
+        }
+        return;
+    }
     MallocMetadata *meta = (MallocMetadata *) ((char *) p - sizeof(MallocMetadata));
     if(meta->is_free)
     {
         return;
     }
-    if (meta->cookie != random_cookie) {
+    if (meta->cookie != blockCookie(meta)) {
         exit(0xdeadbeef);
     }
-    if (meta->mmap_alloc_size > 0) {
-        num_of_alloc_bytes -= meta->mmap_alloc_size;
-        num_of_alloc_blocks--;
-        munmap(meta, _sizeOfBlock(meta) + sizeof(MallocMetadata));
+    Heap *heap = threadHeap();
+    if (meta->is_mmap) {
+        pthread_mutex_lock(&heap->lock);
+        heap->num_of_alloc_bytes -= mmapSize(meta);
+        heap->num_of_alloc_blocks--;
+        heap->num_of_mmap_blocks--;
+        pthread_mutex_unlock(&heap->lock);
+        mmapCachePut((char *) meta - sizeof(size_t), pageRound(mmapSize(meta) + MMAP_HEADER));
     }
-    else {
+    else if (meta->order <= TCACHE_MAX_ORDER) {
+        meta->is_free = true;
+        tcachePush(meta);
+        if (tcache.counts[meta->order] > TCACHE_LIMIT) {
+            tcacheFlush(meta->order, TCACHE_LIMIT / 2);
+        }
+    }
+    else if (arena->heap != heap) {
         meta->is_free = true;
-        num_of_free_blocks++;
-        num_of_free_bytes += (_sizeOfBlock(meta) - sizeof(MallocMetadata));
-        orderListInsert(meta);
-        meta = memoryMerge(meta);
+        remoteFree(arena->heap, p);
+    }
+    else {
+        pthread_mutex_lock(&heap->lock);
+        buddyFree(heap, meta);
+        pthread_mutex_unlock(&heap->lock);
+    }
+}
+
+// resizes an mmap chunk in place when it shrinks, unmapping its tail pages, and lets the kernel
+// move its pages when it grows, so the data is never copied
+void *mmapResize(MallocMetadata *meta, size_t size) {
+    size_t old_size = mmapSize(meta);
+    char *chunk = (char *) meta - sizeof(size_t);
+    size_t old_length = pageRound(old_size + MMAP_HEADER);
+    size_t length = pageRound(size + MMAP_HEADER);
+    if (length < old_length) {
+        munmap(chunk + length, old_length - length);
+    }
+    else if (length > old_length) {
+        void *ptr = mremap(chunk, old_length, length, MREMAP_MAYMOVE);
+        if (ptr == MAP_FAILED) {
+            return nullptr;
+        }
+        chunk = (char *) ptr;
+        meta = (MallocMetadata *) (chunk + sizeof(size_t));
+        meta->cookie = blockCookie(meta);
     }
+    mmapSize(meta) = size;
+    Heap *heap = threadHeap();
+    pthread_mutex_lock(&heap->lock);
+    heap->num_of_alloc_bytes += size - old_size;
+    pthread_mutex_unlock(&heap->lock);
+    return chunk + MMAP_HEADER;
 }
 
 void *srealloc(void *oldp, size_t size) {
@@ -323,68 +951,108 @@ void *srealloc(void *oldp, size_t size) {
     if (oldp == nullptr) {
         return smalloc(size);
     }
+    Arena *arena = arenaOf(oldp);
+    if (arena != nullptr && isSlabObject(arena, oldp)) {
+        size_t old_size = slab_sizes[slabOf(oldp)->size_class];
+        if (size <= old_size) {
+            return oldp;
+        }
+        void *ptr = smalloc(size);
+        if (ptr != nullptr) {
+            memmove(ptr, oldp, old_size);
+            sfree(oldp);
+        }
+        return ptr;
+    }
     MallocMetadata *block = (MallocMetadata *) ((char *) oldp - sizeof(MallocMetadata));
-    if (block->cookie != random_cookie) {
+    if (block->cookie != blockCookie(block)) {
         exit(0xdeadbeef);
     }
-    if (size >= 131072) {
-        if(block->mmap_alloc_size == size){
-            return oldp;
+    if (block->is_mmap) {
+        if (size >= MMAP_THRESHOLD) {
+            return mmapResize(block, size);
         }
-        void *ptr = smalloc(size);
-        memmove(ptr, oldp, block->mmap_alloc_size);
-        sfree(oldp);
-        return (void *) ((char *) ptr + sizeof(MallocMetadata));
     }
-    if (size <= _sizeOfBlock(block)) {
+    else if (size <= _sizeOfBlock(block) - sizeof(MallocMetadata)) {
         return oldp;
- 
     }
-    else {
+    else if (size < MMAP_THRESHOLD) {
         MallocMetadata *iter = block;
         MallocMetadata *buddy;
+        Heap *heap = arenaOf(block)->heap;
+        pthread_mutex_lock(&heap->lock);
         for (int i = iter->order; i < MAX_ORDER; i++) {
-            buddy = (MallocMetadata *) ((void *) ((std::uintptr_t) iter ^ (int) (128 * pow(2, i))));
-            if (!buddy->is_free) {
+            // the block is taken, so the buddy of its order i part is free when the pair differs
+            if (!buddyDiffers(arenaOf(iter), iter, i)) {
                 break;
             }
-            if (size <= 128 * (int)pow(2,(i + 1)) - sizeof(MallocMetadata)) {
-                orderListInsert(block);
+            if (size <= blockSize(i + 1) - sizeof(MallocMetadata)) {
+                // the list links overwrite the start of the data while the block is merged
+                FreeLinks data = *freeLinks(block);
+                size_t old_size = _sizeOfBlock(block) - sizeof(MallocMetadata);
+                orderListInsert(heap, block);
                 block->is_free = true;
                 for (int j = iter->order; j <= i; j++) {
-                    buddy = (MallocMetadata *) ((void *) ((std::uintptr_t) iter ^ (int)(128 * pow(2,j))));
-                    iter = mergeBlocks(iter, buddy);
-                    num_of_free_bytes -= ((int)pow(2,iter->order-1) * 128);
+                    buddy = (MallocMetadata *) ((void *) ((std::uintptr_t) iter ^ blockSize(j)));
+                    iter = mergeBlocks(heap, iter, buddy);
+                    heap->num_of_free_bytes -= blockSize(iter->order - 1);
                 }
 		iter->is_free=false;
-		orderListRemove(iter);
-		 memmove((void *) ((char *) iter + sizeof(MallocMetadata)), oldp, _sizeOfBlock(block) -sizeof(MallocMetadata));
+		orderListRemove(heap, iter);
+		pthread_mutex_unlock(&heap->lock);
+		 memmove((void *) ((char *) iter + sizeof(MallocMetadata)), oldp, old_size);
+		*freeLinks(iter) = data;
                 return (void *) ((char *) iter + sizeof(MallocMetadata));
             }
         }
+        pthread_mutex_unlock(&heap->lock);
+    }
+    size_t old_size = block->is_mmap ? mmapSize(block) : _sizeOfBlock(block) - sizeof(MallocMetadata);
+    void *ptr = smalloc(size);
+    if (ptr != nullptr) {
+        memmove(ptr, oldp, old_size < size ? old_size : size);
+        sfree(oldp);
+    }
+    return ptr;
+}
+
+// sums a counter of all heaps, and adds what the thread caches hold for cached
+static size_t heapStat(size_t Heap::*counter, std::atomic<size_t> TCache::*cached) {
+    size_t value = 0;
+    for (int i = 0; i < HEAPS_MAX; i++) {
+        pthread_mutex_lock(&heaps[i].lock);
+        remoteDrain(&heaps[i]);
+        value += heaps[i].*counter;
+        pthread_mutex_unlock(&heaps[i].lock);
+    }
+    if (cached != nullptr) {
+        pthread_mutex_lock(&tcaches_lock);
+        for (TCache *iter = tcaches; iter != nullptr; iter = iter->next) {
+            value += (iter->*cached).load(std::memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&tcaches_lock);
     }
-    sfree(oldp);
-    return smalloc(size);
+    return value;
 }
 
 size_t _num_free_blocks() {
-    return num_of_free_blocks;
+    return heapStat(&Heap::num_of_free_blocks, &TCache::cached_blocks);
 }
 
 size_t _num_free_bytes() {
-    return num_of_free_bytes;
+    return heapStat(&Heap::num_of_free_bytes, &TCache::cached_bytes);
 }
 
 size_t _num_allocated_blocks() {
-    return num_of_alloc_blocks;
+    return heapStat(&Heap::num_of_alloc_blocks, nullptr);
 }
 
 size_t _num_allocated_bytes() {
-    return num_of_alloc_bytes;
+    return heapStat(&Heap::num_of_alloc_bytes, nullptr);
 }
 
 size_t _num_meta_data_bytes() {
-    return sizeof(MallocMetadata) * _num_allocated_blocks();
+    return sizeof(MallocMetadata) * _num_allocated_blocks() + sizeof(size_t) * heapStat(&Heap::num_of_mmap_blocks, nullptr);
 }
 
 size_t _size_meta_data() {